@@ -7,9 +7,23 @@ struct Report {
     long connected;
     long closed;
     long recved;
+    long rssKb;
     Report() { memset(this, 0, sizeof(*this)); }
 };
 
+//当前进程的常驻内存，KB
+static long rssKb() {
+    long pages = 0, rss = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &rss) != 2) {
+            rss = 0;
+        }
+        fclose(f);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 int main(int argc, const char* argv[]) {
     if (argc < 5) {
         printf("usage: %s <begin port> <end port> <subprocesses> <management port>\n", argv[0]);
@@ -29,26 +43,24 @@ int main(int argc, const char* argv[]) {
     EventBase base;
     if (pid == 0) { //child process
         usleep(100*1000); // wait master to listen management port
+        long base_rss = rssKb(); //连接建立前的内存，用于计算每个连接的内存
         vector<TcpServerPtr> svrs;
         long connected = 0, closed = 0, recved = 0;
         for (int i = 0; i < end_port-begin_port; i ++) {
             TcpServerPtr p = TcpServer::startServer(&base, "", begin_port + i, true);
-            p->onConnCreate([&]{
-                TcpConnPtr con(new TcpConn);
-                con->onState([&](const TcpConnPtr& con) {
-                    auto st = con->getState();
-                    if (st == TcpConn::Connected) {
-                        connected ++;
-                    } else if (st == TcpConn::Closed || st == TcpConn::Failed) {
-                        closed ++;
-                        connected --;
-                    }
-                });
-                con->onMsg(new LengthCodec, [&](const TcpConnPtr& con, Slice msg) {
-                    recved ++;
-                    con->sendMsg(msg);
-                });
-                return con;
+            //回调设置在服务器上，所有连接共享同一份
+            p->onConnState([&](const TcpConnPtr& con) {
+                auto st = con->getState();
+                if (st == TcpConn::Connected) {
+                    connected ++;
+                } else if (st == TcpConn::Closed || st == TcpConn::Failed) {
+                    closed ++;
+                    connected --;
+                }
+            });
+            p->onConnMsg(new LengthCodec, [&](const TcpConnPtr& con, Slice msg) {
+                recved ++;
+                con->sendMsg(msg);
             });
             svrs.push_back(p);
         }
@@ -65,7 +77,7 @@ int main(int argc, const char* argv[]) {
             }
         });
         base.runAfter(100, [&]() {
-            report->sendMsg(util::format("%d connected: %ld closed: %ld recved: %ld", getpid(), connected, closed, recved));
+            report->sendMsg(util::format("%d connected: %ld closed: %ld recved: %ld rss: %ld", getpid(), connected, closed, recved, rssKb() - base_rss));
         }, 100);
         base.loop();
     } else {
@@ -73,19 +85,21 @@ int main(int argc, const char* argv[]) {
         TcpServerPtr master = TcpServer::startServer(&base, "127.0.0.1", man_port);
         master->onConnMsg(new LineCodec, [&](const TcpConnPtr& con, Slice msg) {
             auto fs = msg.split(' ');
-            if (fs.size() != 7) {
-                error("number of fields is %lu expected 7", fs.size());
+            if (fs.size() != 9) {
+                error("number of fields is %lu expected 9", fs.size());
                 return;
             }
             Report& c = subs[atoi(fs[0].data())];
             c.connected = atoi(fs[2].data());
             c.closed = atoi(fs[4].data());
             c.recved = atoi(fs[6].data());
+            c.rssKb = atoi(fs[8].data());
         });
         base.runAfter(3000, [&](){
             for(auto& s: subs) {
                 Report r = s.second;
-                printf("pid: %6d connected %6ld closed: %6ld recved %6ld\n", s.first, r.connected, r.closed, r.recved);
+                printf("pid: %6d connected %6ld closed: %6ld recved %6ld rss %6ld KB %.2f KB/conn\n", s.first, r.connected,
+                       r.closed, r.recved, r.rssKb, r.connected ? (double)r.rssKb / r.connected : 0);
             }
             printf("\n");
         }, 3000);
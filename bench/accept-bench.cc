@@ -0,0 +1,71 @@
+/*
+ * 比较单个监听socket与每个循环各自监听时的accept速率
+ * 运行：./accept-bench <single|perloop|steer> [循环数] [客户端线程数] [秒数]
+ * 客户端线程不断阻塞connect，服务端建立连接后立即关闭，客户端读到EOF后关闭，TIME_WAIT留在服务端，不耗尽客户端端口
+ * single为原有方式：一个循环accept后经safeCall交给其他循环；perloop每个循环一个reuseport监听；steer额外按cpu分配
+ */
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+int main(int argc, const char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode != "single" && mode != "perloop" && mode != "steer") {
+        printf("usage: %s <single|perloop|steer> [loops] [client threads] [seconds]\n", argv[0]);
+        return 1;
+    }
+    int loops = argc > 2 ? atoi(argv[2]) : 4;
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 3;
+    setloglevel("WARN");
+
+    MultiBase bases(loops);
+    if (mode == "steer") {
+        bases.setAffinity();
+    }
+    TcpServerPtr svr = mode == "single" ? TcpServer::startServer(&bases, "127.0.0.1", 2099)
+        : TcpServer::startPerLoopServer(&bases, "127.0.0.1", 2099, mode == "steer");
+    exitif(svr == NULL, "start tcp server failed");
+    atomic<int64_t> accepted(0);
+    svr->onConnState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            accepted ++;
+            con->close();
+        }
+    });
+    thread svrThread([&] { bases.loop(); });
+
+    atomic<bool> stop(false);
+    atomic<int64_t> connected(0);
+    vector<thread> ths;
+    Ip4Addr addr("127.0.0.1", 2099);
+    for (int i = 0; i < clients; i ++) {
+        ths.push_back(thread([&] {
+            while (!stop) {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                char c;
+                if (connect(fd, (sockaddr*)&addr.getAddr(), sizeof(sockaddr_in)) == 0 && read(fd, &c, 1) == 0) {
+                    connected ++;
+                }
+                close(fd);
+            }
+        }));
+    }
+    int64_t start = util::timeMicro();
+    sleep(seconds);
+    stop = true;
+    for (auto& th: ths) {
+        th.join();
+    }
+    int64_t used = util::timeMicro() - start;
+    usleep(100 * 1000);
+    bases.exit();
+    svrThread.join();
+    printf("mode %s loops %d clients %d: connected %lld accepted %lld, %.0f accepts/s\n", mode.c_str(), loops, clients,
+           (long long)connected.load(), (long long)accepted.load(), accepted * 1e6 / used);
+    AcceptStat st = svr->acceptStat();
+    printf("accept wakeups %lld, %.2f conns/wakeup, budget hits %lld, failed %lld\n", (long long)st.wakeups,
+           st.wakeups ? (double)st.accepted / st.wakeups : 0, (long long)st.budgetHits, (long long)st.failed);
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * 比较MultiBase各分配策略在连接负载不均时的延迟
+ * 运行：./dispatch-bench <rr|conns|busy|hash> [循环数] [连接数] [秒数] [重连接每次请求的处理微秒数]
+ * 连接每隔20毫秒建立一个，每4个连接中有1个是重连接，服务端处理它的每个请求都要忙等一段时间
+ * 其余轻连接的请求立即返回，统计轻连接一问一答的延迟分布
+ */
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+static void burn(int us) {
+    int64_t end = util::timeMicro() + us;
+    while (util::timeMicro() < end) {
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    map<string, MultiBase::Policy> policies = {
+        {"rr", MultiBase::RoundRobin}, {"conns", MultiBase::LeastConns},
+        {"busy", MultiBase::LeastBusy}, {"hash", MultiBase::PeerHash},
+    };
+    if (argc < 2 || !policies.count(argv[1])) {
+        printf("usage: %s <rr|conns|busy|hash> [loops] [conns] [seconds] [heavy us]\n", argv[0]);
+        return 1;
+    }
+    int loops = argc > 2 ? atoi(argv[2]) : 4;
+    int conns = argc > 3 ? atoi(argv[3]) : 32;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+    int heavyUs = argc > 5 ? atoi(argv[5]) : 300;
+    setloglevel("WARN");
+
+    MultiBase svrBases(loops, policies[argv[1]]);
+    TcpServerPtr svr = TcpServer::startServer(&svrBases, "127.0.0.1", 2099);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->onConnRead([=](const TcpConnPtr& con) {
+        Buffer& in = con->getInput();
+        for (size_t i = 0; i < in.size(); i ++) {
+            if (in.data()[i] == 'H') {
+                burn(heavyUs);
+            }
+        }
+        con->send(in);
+    });
+    thread svrThread([&] { svrBases.loop(); });
+
+    EventBase cliBase;
+    Histogram light;
+    vector<TcpConnPtr> clis;
+    for (int i = 0; i < conns; i ++) {
+        cliBase.runAfter(i * 20, [&, i] {
+            char req = i % 4 == 0 ? 'H' : 'L';
+            TcpConnPtr con = TcpConn::createConnection(&cliBase, "127.0.0.1", 2099);
+            shared_ptr<int64_t> sent(new int64_t(0));
+            con->onState([=](const TcpConnPtr& con) {
+                if (con->getState() == TcpConn::Connected) {
+                    *sent = util::timeMicro();
+                    con->send(&req, 1);
+                }
+            });
+            con->onRead([=, &light](const TcpConnPtr& con) {
+                con->getInput().clear();
+                int64_t now = util::timeMicro();
+                if (req == 'L') {
+                    light.add(now - *sent);
+                }
+                *sent = now;
+                con->send(&req, 1);
+            });
+            clis.push_back(con);
+        });
+    }
+    cliBase.runAfter(conns * 20 + seconds * 1000, [&] { cliBase.exit(); });
+    cliBase.loop();
+    svrBases.exit();
+    svrThread.join();
+
+    printf("policy %s loops %d conns %d heavy %d us\n", argv[1], loops, conns, heavyUs);
+    for (int i = 0; i < loops; i ++) {
+        printf("  loop %d conns %d busy %lld ms\n", i, svrBases.getBase(i)->connCount(),
+               (long long)svrBases.getBase(i)->loopMetrics().busyUs.sum() / 1000);
+    }
+    printf("light request latency us: %s\n", light.toString().c_str());
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * 比较水平触发与边缘触发下的回显吞吐
+ * 运行：./et-bench <lt|et> [连接数] [秒数] [每个连接在途字节数]
+ * 服务端与客户端各占一个线程，双方都把收到的数据原样发回，统计服务端转发的字节数
+ */
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2 || (strcmp(argv[1], "lt") && strcmp(argv[1], "et"))) {
+        printf("usage: %s <lt|et> [conns] [seconds] [window bytes]\n", argv[0]);
+        return 1;
+    }
+    bool edge = strcmp(argv[1], "et") == 0;
+    int conns = argc > 2 ? atoi(argv[2]) : 100;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    int window = argc > 4 ? atoi(argv[4]) : 256*1024;
+    setloglevel("WARN");
+
+    EventBase svrBase, cliBase;
+    svrBase.setEdgeTrigger(edge);
+    cliBase.setEdgeTrigger(edge);
+    atomic<int64_t> bytes(0);
+    TcpServerPtr svr = TcpServer::startServer(&svrBase, "127.0.0.1", 2099);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->onConnRead([&](const TcpConnPtr& con) {
+        bytes += con->getInput().size();
+        con->send(con->getInput());
+    });
+    thread th([&]{ svrBase.loop(); });
+
+    string payload(window, 'x');
+    vector<TcpConnPtr> clis;
+    for (int i = 0; i < conns; i ++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliBase, "127.0.0.1", 2099);
+        con->onState([&](const TcpConnPtr& con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->send(payload);
+            }
+        });
+        con->onRead([](const TcpConnPtr& con) { con->send(con->getInput()); });
+        clis.push_back(con);
+    }
+    int64_t start = util::timeMilli();
+    cliBase.runAfter(seconds*1000, [&]{ cliBase.exit(); });
+    cliBase.loop();
+    int64_t used = util::timeMilli() - start;
+    svrBase.exit();
+    th.join();
+    printf("%s conns %d window %d: %.2f MB/s\n", edge ? "edge-triggered" : "level-triggered",
+        conns, window, bytes / 1024.0 / 1024 * 1000 / used);
+}
@@ -0,0 +1,43 @@
+/*
+ * 测试多个线程同时向一个EventBase调用safeCall的吞吐
+ * 运行：./safecall-bench [最多生产者线程数] [每个线程的任务数]
+ * 依次用1..N个生产者线程测试，事件循环所在线程执行任务并计数
+ */
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+int main(int argc, const char* argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 4;
+    int tasks = argc > 2 ? atoi(argv[2]) : 1000000;
+    setloglevel("WARN");
+
+    for (int n = 1; n <= maxThreads; n ++) {
+        EventBase base;
+        int64_t done = 0;
+        int64_t total = (int64_t)n * tasks;
+        thread loop([&] { base.loop(); });
+        int64_t start = util::timeMicro();
+        vector<thread> producers;
+        for (int i = 0; i < n; i ++) {
+            producers.push_back(thread([&] {
+                for (int j = 0; j < tasks; j ++) {
+                    base.safeCall([&] {
+                        if (++done == total) {
+                            base.exit();
+                        }
+                    });
+                }
+            }));
+        }
+        for (auto& t: producers) {
+            t.join();
+        }
+        loop.join();
+        int64_t used = util::timeMicro() - start;
+        printf("%d producers: %lld tasks in %.3f s, %.2f M tasks/s\n",
+               n, (long long)total, used / 1e6, total / (double)used);
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * 测试单个EventBase上大量定时器的添加、取消与到期
+ * 运行：./timer-bench [定时器数] [最长超时毫秒] [取消后重新添加的次数]
+ * 先添加指定数量的定时器，再做取消加重新添加的混合操作（类似连接超时不断被刷新），最后运行事件循环直到全部到期
+ * 所有定时器在启动5秒后才开始到期，避免准备阶段耗时影响延迟统计
+ */
+#include <handy/handy.h>
+#include <random>
+
+using namespace std;
+using namespace handy;
+
+int main(int argc, const char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int maxDelay = argc > 2 ? atoi(argv[2]) : 5000;
+    int churn = argc > 3 ? atoi(argv[3]) : 1000000;
+    setloglevel("WARN");
+
+    EventBase base;
+    mt19937 rnd(1);
+    vector<TimerId> ids(count);
+    int64_t fired = 0, late = 0, maxLate = 0;
+    auto timer = [&](int64_t at) {
+        return [&, at] {
+            int64_t l = util::timeMilli() - at;
+            fired ++;
+            late += l;
+            maxLate = max(maxLate, l);
+            if (fired == count) {
+                base.exit();
+            }
+        };
+    };
+
+    int64_t begin = util::timeMilli() + 5000;
+    int64_t start = util::timeMicro();
+    for (int i = 0; i < count; i ++) {
+        int64_t at = begin + rnd() % maxDelay;
+        ids[i] = base.runAt(at, timer(at));
+    }
+    int64_t used = util::timeMicro() - start;
+    printf("add %d timers: %.1f ns/op\n", count, used * 1000.0 / count);
+
+    start = util::timeMicro();
+    for (int i = 0; i < churn; i ++) {
+        int k = rnd() % count;
+        base.cancel(ids[k]);
+        int64_t at = begin + rnd() % maxDelay;
+        ids[k] = base.runAt(at, timer(at));
+    }
+    used = util::timeMicro() - start;
+    printf("cancel+add %d times with %d outstanding: %.1f ns/op\n", churn, count, churn ? used * 1000.0 / churn : 0);
+
+    start = util::timeMicro();
+    base.loop();
+    used = util::timeMicro() - start;
+    printf("fired %lld timers in %.1f s, avg late %.2f ms, max late %lld ms\n",
+           (long long)fired, used / 1e6, fired ? (double)late / fired : 0, (long long)maxLate);
+    return 0;
+}
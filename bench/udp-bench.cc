@@ -0,0 +1,91 @@
+/*
+ * 比较UdpServer逐个收发与recvmmsg/sendmmsg批量收发的吞吐
+ * 运行：./udp-bench [批量大小] [客户端数] [每个客户端在途报文数] [秒数] [报文字节] [服务端循环数]
+ * 服务端同examples/udp-svr.cc回显报文，客户端同examples/udp-cli.cc，收到回复后再发一个，保持在途报文数
+ * 依次用批量1（每个报文一次recvfrom/sendto）与指定的批量大小各测一次
+ * 服务端循环数大于1时每个循环各开一个reuseport socket，输出每个socket收到的报文数
+ * 客户端仍逐个收发，单机测试时总吞吐常受客户端限制，服务端每cpu秒处理的报文数更能反映批量的收益
+ */
+#include <handy/handy.h>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace handy;
+
+static int64_t cpuUs(int who) {
+    struct rusage ru;
+    getrusage(who, &ru);
+    return ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+}
+
+int main(int argc, const char* argv[]) {
+    int batch = argc > 1 ? atoi(argv[1]) : 32;
+    int clients = argc > 2 ? atoi(argv[2]) : 16;
+    int window = argc > 3 ? atoi(argv[3]) : 32;
+    int seconds = argc > 4 ? atoi(argv[4]) : 3;
+    int msgSize = argc > 5 ? atoi(argv[5]) : 64;
+    int loops = argc > 6 ? atoi(argv[6]) : 1;
+    setloglevel("WARN");
+
+    for (int b : {1, batch}) {
+        MultiBase svrBases(loops);
+        UdpServerPtr svr = UdpServer::startPerLoopServer(&svrBases, "127.0.0.1", 2099);
+        exitif(!svr, "start udp server failed");
+        svr->setBatch(b);
+        svr->onMsgs([&](const UdpServerPtr& p, UdpMsg* msgs, int n) {
+            for (int i = 0; i < n; i ++) {
+                p->sendTo(msgs[i].buf, msgs[i].peer);
+            }
+        });
+        thread svrThread([&] { svrBases.loop(); });
+
+        EventBase base;
+        string msg(msgSize, 'x');
+        int64_t replies = 0;
+        vector<UdpConnPtr> cons;
+        for (int i = 0; i < clients; i ++) {
+            UdpConnPtr con = UdpConn::createConnection(&base, "127.0.0.1", 2099);
+            exitif(!con, "create udp conn failed");
+            con->onMsg([&](const UdpConnPtr& con, Buffer) {
+                replies ++;
+                con->send(msg);
+            });
+            for (int j = 0; j < window; j ++) {
+                con->send(msg);
+            }
+            cons.push_back(con);
+        }
+        //丢包后在途报文减少，定时补足
+        base.runAfter(100, [&] {
+            for (auto& con : cons) {
+                con->send(msg);
+            }
+        }, 100);
+        //服务端cpu时间为进程的cpu时间减去客户端所在的本线程
+        int64_t cpu0 = cpuUs(RUSAGE_SELF) - cpuUs(RUSAGE_THREAD);
+        int64_t start = util::timeMicro();
+        base.runAfter(seconds * 1000, [&] { base.exit(); });
+        base.loop();
+        int64_t used = util::timeMicro() - start;
+        int64_t svrCpu = cpuUs(RUSAGE_SELF) - cpuUs(RUSAGE_THREAD) - cpu0;
+        svrBases.exit();
+        svrThread.join();
+        int64_t reads = 0;
+        string perSock;
+        for (int i = 0; i < svr->sockets(); i ++) {
+            UdpStat st = svr->stat(i);
+            reads += st.reads;
+            perSock += util::format(" %lld", (long long)st.recvMsgs);
+        }
+        for (auto& con : cons) {
+            con->close();
+        }
+        printf("batch %2d: %lld replies in %.2f s, %.0f msgs/s, server cpu %.2f s, %.0f msgs per server cpu second, %.1f msgs per read\n",
+               b, (long long)replies, used / 1e6, replies * 1e6 / used, svrCpu / 1e6, svrCpu ? replies * 1e6 / svrCpu : 0,
+               reads ? (double)replies / reads : 0);
+        if (loops > 1) {
+            printf("  msgs per socket:%s\n", perSock.c_str());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * 比较loopback上开启与不开启UDP GSO/GRO时同样大小报文的吞吐
+ * 运行：./udp-gso-bench [报文字节] [每次发送的报文数] [秒数]
+ * 发送线程用UdpConn不停发送：不开启时每个报文一次send，开启GSO时把多个报文拼在一起一次send由内核切分
+ * 接收端是批量收取的UdpServer，开启时同时开启GRO，按UdpMsg::segSize计算收到的报文数
+ */
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+int main(int argc, const char* argv[]) {
+    int segSize = argc > 1 ? atoi(argv[1]) : 1400;
+    int segs = argc > 2 ? atoi(argv[2]) : 32;
+    int seconds = argc > 3 ? atoi(argv[3]) : 3;
+    segs = max(1, min(segs, min(kUdpMaxSegments, kUdpMaxGsoSize / segSize)));
+    setloglevel("WARN");
+
+    for (bool offload : {false, true}) {
+        EventBase svrBase;
+        UdpServerPtr svr = UdpServer::startServer(&svrBase, "127.0.0.1", 2099);
+        exitif(!svr, "start udp server failed");
+        svr->setBatch(32);
+        if (offload) {
+            int r = svr->setGro(true);
+            exitif(r, "setGro failed %d %s", r, strerror(r));
+        }
+        int64_t pkts = 0, bytes = 0, reads = 0;
+        svr->onMsgs([&](const UdpServerPtr&, UdpMsg* msgs, int n) {
+            for (int i = 0; i < n; i ++) {
+                size_t sz = msgs[i].buf.size();
+                pkts += msgs[i].segSize ? (sz + msgs[i].segSize - 1) / msgs[i].segSize : 1;
+                bytes += sz;
+            }
+            reads += n;
+        });
+        thread svrThread([&] { svrBase.loop(); });
+
+        EventBase base;
+        UdpConnPtr con = UdpConn::createConnection(&base, "127.0.0.1", 2099);
+        exitif(!con, "create udp conn failed");
+        if (offload) {
+            int r = con->setGso(segSize);
+            exitif(r, "setGso failed %d %s", r, strerror(r));
+        }
+        string msg(segSize * (offload ? segs : 1), 'x');
+        int64_t sent = 0, start = util::timeMicro(), deadline = start + seconds * 1000000LL;
+        while (util::timeMicro() < deadline) {
+            for (int i = 0; i < 64; i ++) {
+                con->send(msg);
+            }
+            sent += 64 * (offload ? segs : 1);
+        }
+        int64_t used = util::timeMicro() - start;
+        usleep(100 * 1000);
+        svrBase.exit();
+        svrThread.join();
+        con->close();
+        printf("%-8s seg %d: sent %.0f pkts/s, received %.0f pkts/s %.1f MB/s, %.1f pkts per received msg\n",
+               offload ? "gso/gro" : "plain", segSize, sent * 1e6 / used, pkts * 1e6 / used, bytes / 1048576.0 * 1e6 / used,
+               reads ? (double)pkts / reads : 0);
+    }
+    return 0;
+}
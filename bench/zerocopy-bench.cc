@@ -0,0 +1,74 @@
+/*
+ * 比较普通发送与MSG_ZEROCOPY发送大块数据的吞吐
+ * 运行：./zerocopy-bench <write|zerocopy> [消息KB] [总MB] [服务端地址]
+ * 服务端在另一个线程中读取并丢弃数据，客户端每次用sendRef发送同一块内存，输出队列低于4条消息时再补充
+ * loopback上内核仍会复制（完成通知带COPIED标志），要看到收益需在两台机器之间经真实网卡测试
+ */
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+int main(int argc, const char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode != "write" && mode != "zerocopy") {
+        printf("usage: %s <write|zerocopy> [msg KB] [total MB] [server ip]\n", argv[0]);
+        return 1;
+    }
+    size_t msgSize = (argc > 2 ? atoi(argv[2]) : 64) * 1024;
+    int64_t total = (int64_t)(argc > 3 ? atoi(argv[3]) : 4096) << 20;
+    string host = argc > 4 ? argv[4] : "127.0.0.1";
+    setloglevel("WARN");
+
+    EventBase svrBase;
+    TcpServerPtr svr;
+    if (host == "127.0.0.1") {
+        svr = TcpServer::startServer(&svrBase, host, 2099);
+        exitif(svr == NULL, "start tcp server failed");
+        svr->onConnRead([](const TcpConnPtr& con) { con->getInput().clear(); });
+    }
+    thread svrThread([&] { svrBase.loop(); });
+
+    EventBase base;
+    string msg(msgSize, 'x');
+    int64_t queued = 0, start = 0;
+    int zc = 0;
+    TcpConnPtr con = TcpConn::createConnection(&base, host, 2099);
+    auto fill = [&](const TcpConnPtr& con) {
+        while (queued < total && con->outputSize() < 4 * msgSize) {
+            size_t n = (size_t)min((int64_t)msgSize, total - queued);
+            con->sendRef(msg.data(), n, nullptr);
+            queued += n;
+        }
+        if (queued >= total && con->outputSize() == 0) {
+            base.exit();
+        }
+    };
+    con->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            if (mode == "zerocopy") {
+                zc = con->setZeroCopy(msgSize);
+                exitif(zc, "setZeroCopy failed %d %s", zc, strerror(zc));
+            }
+            start = util::timeMicro();
+            fill(con);
+        } else {
+            base.exit();
+        }
+    });
+    con->onWritable(fill);
+    base.loop();
+    int64_t used = util::timeMicro() - start;
+    svrBase.exit();
+    svrThread.join();
+
+    ZeroCopyStat st = con->zeroCopyStat();
+    printf("%s msg %lu KB: %lld MB in %.2f s, %.1f MB/s\n", mode.c_str(), (unsigned long)msgSize / 1024,
+           (long long)(queued >> 20), used / 1e6, used ? (queued >> 20) * 1e6 / used : 0);
+    if (mode == "zerocopy") {
+        printf("  sends %lld completions %lld copied %lld fallbacks %lld pending %lld\n",
+               (long long)st.sends, (long long)st.completions, (long long)st.copied,
+               (long long)st.fallbacks, (long long)st.pending);
+    }
+    return 0;
+}
@@ -20,6 +20,7 @@ int main(int argc, const char* argv[]) {
     });
     sample.onCmd("stop", "stop program", [&] { base.safeCall([&]{base.exit();}); return "stoping"; });
     sample.onPage("page", "show page content", [] { return "this is a page"; });
+    sample.onLoop("loop", &base);
     Signal::signal(SIGINT, [&]{base.exit();});
     base.loop();
     return 0;
@@ -3,6 +3,10 @@
 #include <poll.h>
 #include <fcntl.h>
 #include "poller.h"
+#ifdef OS_LINUX
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#endif
 
 //channel是读写的通道
 using namespace std;
@@ -10,35 +14,55 @@ namespace handy {
 
 void handyUnregisterIdle(EventBase* base, const IdleId& idle);
 void handyUpdateIdle(EventBase* base, const IdleId& idle);
+void handyConnAttached(EventBase* base);
+void handyConnClosed(EventBase* base);
 
 //把事件管理器附加到TcpConn上
-void TcpConn::attach(EventBase* base, int fd, Ip4Addr local, Ip4Addr peer)
+void TcpConn::attach(EventBase* base, int fd, Ip4Addr local, Ip4Addr peer, bool nonBlocked)
 {
-    fatalif((destPort_<=0 && state_ != State::Invalid) || (destPort_>=0 && state_ != State::Handshaking),
+    fatalif((!isClient() && state_ != State::Invalid) || (isClient() && state_ != State::Handshaking),
         "you should use a new TcpConn to attach. state: %d", state_); //判断下能不能attach上
     base_ = base;
+    handyConnAttached(base);
     state_ = State::Handshaking;
     local_ = local;
     peer_ = peer;
-    delete channel_;
-    channel_ = new Channel(base, fd, kWriteEvent|kReadEvent);  //建一个channel
+    closeChannel();
+    channel_ = new (channelBuf_) Channel(base, fd, kWriteEvent|kReadEvent, base->edgeTrigger(), nonBlocked);  //建一个channel
+    if (base->busyPoll() && net::setBusyPoll(fd, base->busyPoll())) {
+        static std::atomic<bool> warned(false); //权限不足时每个连接都会失败，只提示一次
+        if (!warned.exchange(true)) {
+            warn("set SO_BUSY_POLL %d for fd %d failed %d %s", base->busyPoll(), fd, errno, strerror(errno));
+        }
+    }
     trace("tcp constructed %s - %s fd: %d",
         local_.toString().c_str(),
         peer_.toString().c_str(),
         fd);
-    TcpConnPtr con = shared_from_this();  //就是TcpConn con
-    con->channel_->onRead([=] { con->handleRead(con); }); //设上回调函数
-    con->channel_->onWrite([=] { con->handleWrite(con); }); //设上回调函数
+    self_ = shared_from_this();  //channel打开期间由自己持有，cleanup时释放
+    channel_->onRead([this] { handleRead(self_); }); //设上回调函数
+    channel_->onWrite([this] { handleWrite(self_); }); //设上回调函数
+    channel_->onError([this] { handleError(self_); });
+    if (zc_) { //重连后是新的socket，序号从0开始
+        zc_->pending.clear();
+        zc_->next = zc_->frontDone = 0;
+        zc_->first = -1;
+        if (net::setZeroCopy(fd)) {
+            warn("set SO_ZEROCOPY for fd %d failed %d %s", fd, errno, strerror(errno));
+            zc_.reset();
+        }
+    }
 }
 
 void TcpConn::connect(EventBase* base, const string& host, short port, int timeout, const string& localip) {
     fatalif(state_ != State::Invalid && state_ != State::Closed && state_ != State::Failed,
             "current state is bad state to connect. state: %d", state_);
-    destHost_ = host;
-    destPort_ = port;
-    connectTimeout_ = timeout;
-    connectedTime_ = util::timeMilli();
-    localIp_ = localip;
+    TcpClientInfo& ci = clientInfo();
+    ci.destHost = host;
+    ci.destPort = port;
+    ci.connectTimeout = timeout;
+    ci.connectedTime = util::timeMilli();
+    ci.localIp = localip;
     Ip4Addr addr(host, port);
     int fd = socket(AF_INET, SOCK_STREAM, 0);  //连接
     fatalif(fd<0, "socket failed %d %s", errno, strerror(errno));
@@ -67,7 +91,7 @@ void TcpConn::connect(EventBase* base, const string& host, short port, int timeo
         }
     }
     state_ = State::Handshaking;
-    attach(base, fd, Ip4Addr(local), addr);  //把事件处理器绑定在连接上
+    attach(base, fd, Ip4Addr(local), addr, true);  //把事件处理器绑定在连接上，fd已设为非阻塞
     if (timeout) {  //设置了超时
         TcpConnPtr con = shared_from_this();
         timeoutId_ = base->runAfter(timeout, [con] { //设置一个超时函数，将channel关闭
@@ -84,8 +108,11 @@ void TcpConn::close() {   //连接关闭时主要是关闭传输通道
 }
 
 void TcpConn::cleanup(const TcpConnPtr& con) {
-    if (readcb_ && input_.size()) { //清除的时候还有数据可以读
-        readcb_(con);   //读出来处理
+    if (channel_) { //等待重连的连接在循环退出时再次清除，关闭时已减少过连接数
+        handyConnClosed(getBase());
+    }
+    if (cbs_ && cbs_->read && input_.size()) { //清除的时候还有数据可以读
+        cbs_->read(con);   //读出来处理
     }
     if (state_ == State::Handshaking) {   //如果还在握手
         state_ = State::Failed;     //状态置错误
@@ -97,50 +124,91 @@ void TcpConn::cleanup(const TcpConnPtr& con) {
         peer_.toString().c_str(),
         channel_ ? channel_->fd(): -1, errno);
     getBase()->cancel(timeoutId_);  //把定时器去掉
-    if (statecb_) {  //状态转换函数设置
-        statecb_(con); //调用
+    if (cbs_ && cbs_->conns) { //在清除时减少服务器的连接数，用户替换状态回调也不影响
+        (*cbs_->conns) --;
+    }
+    if (cbs_ && cbs_->state) {  //状态转换函数设置
+        cbs_->state(con); //调用
     }
-    if (reconnectInterval_ >= 0 && !getBase()->exited()) { //reconnect
+    if (isClient() && client_->reconnectInterval >= 0 && !getBase()->exited()) { //reconnect
         reconnect();
         return;
     }
     for (auto& idle: idleIds_) {
         handyUnregisterIdle(getBase(), idle);
     }
-    //channel may have hold TcpConnPtr, set channel_ to NULL before delete
-    readcb_ = writablecb_ = statecb_ = nullptr;  //删了之后把指针全部置空
-    Channel* ch = channel_;
-    channel_ = NULL;
-    delete ch;
+    cbs_.reset();  //回调可能持有TcpConnPtr，删了之后置空
+    chunks_.clear(); //未发送的借用数据在此释放
+    std::deque<ZeroCopyState::Pending> pending; //等待完成通知的数据在socket关闭后释放，释放self_可能析构本连接，先移出
+    if (zc_) {
+        pending.swap(zc_->pending);
+    }
+    closeChannel();
+    TcpConnPtr self;
+    self.swap(self_); //最后一个引用时在函数返回时析构本连接
+}
+
+void TcpConn::closeChannel() {
+    if (channel_) {
+        Channel* ch = channel_;
+        channel_ = NULL;
+        ch->~Channel();
+    }
+}
+
+TcpCallBacks& TcpConn::callBacks() {
+    if (!cbs_) {
+        cbs_ = make_shared<TcpCallBacks>();
+    } else if (cbs_.use_count() > 1) { //与服务器的其他连接共享，修改前复制
+        cbs_ = make_shared<TcpCallBacks>(*cbs_);
+    }
+    return *cbs_;
 }
 
 void TcpConn::handleRead(const TcpConnPtr& con) {
     if (state_ == State::Handshaking && handleHandshake(con)) {
         return;
     }
+    char extra[64 * 1024]; //input_剩余空间不够时的栈上备用区，一次readv就能读空socket，不必先扩容或移动数据
+    bool readed = false; //零拷贝的完成通知也会触发读事件，没读到数据时不调用读回调
     while(state_ == State::Connected) {
-        input_.makeRoom();
-        int rd = 0;
+        ssize_t rd = 0;
+        size_t space = input_.space();
         if (channel_->fd() >= 0) {
-            rd = readImp(channel_->fd(), input_.end(), input_.space()); //从end开始写入，读到一个空格
-            trace("channel %lld fd %d readed %d bytes", (long long)channel_->id(), channel_->fd(), rd);
+            struct iovec iov[2];
+            iov[0].iov_base = input_.end(); //从end开始写入
+            iov[0].iov_len = space;
+            iov[1].iov_base = extra;
+            iov[1].iov_len = sizeof extra;
+            rd = readvImp(channel_->fd(), iov, 2);
+            trace("channel %lld fd %d readed %ld bytes", (long long)channel_->id(), channel_->fd(), (long)rd);
         }
-        if (rd == -1 && errno == EINTR) {  //没读到就再循环
-            continue;
-        } else if (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) { //没东西可读
-            for(auto& idle: idleIds_) {
-                handyUpdateIdle(getBase(), idle);
+        if (rd > 0) {
+            readed = true;
+            if ((size_t)rd <= space) {
+                input_.addSize(rd);  //读缓冲区增加Size
+            } else {
+                input_.addSize(space);
+                input_.append(extra, rd - space); //只扩容一次，大小正好
             }
-            if (readcb_ && input_.size()) {
-                readcb_(con);
+            //边缘触发或读满时继续读；水平触发下没读满说明已读空，省去一次返回EAGAIN的read，剩余的EOF下一轮仍可读
+            if (channel_->edgeTriggered() || (size_t)rd == space + sizeof extra) {
+                continue;
             }
-            break;
-        } else if (channel_->fd() == -1 || rd == 0 || rd == -1) {
+        } else if (rd == -1 && errno == EINTR) {  //没读到就再循环
+            continue;
+        } else if (channel_->fd() == -1 || rd == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
             cleanup(con);
             break;
-        } else { //rd > 0
-            input_.addSize(rd);  //读缓冲区增加Size
         }
+        //没东西可读
+        for(auto& idle: idleIds_) {
+            handyUpdateIdle(getBase(), idle);
+        }
+        if (readed && cbs_ && cbs_->read && input_.size()) {
+            cbs_->read(con);
+        }
+        break;
     }
 }
 
@@ -151,14 +219,18 @@ int TcpConn::handleHandshake(const TcpConnPtr& con) { //连接处理握手
     pfd.events = POLLOUT | POLLERR;
     int r = poll(&pfd, 1, 0);
     if (r == 1 && pfd.revents == POLLOUT) {
-        channel_->enableReadWrite(true, false);
+        if (!channel_->edgeTriggered()) { //边缘触发下写事件一直保持注册
+            channel_->enableReadWrite(true, !output_.empty() || !chunks_.empty());
+        }
         state_ = State::Connected;
         if (state_ == State::Connected) {
-            connectedTime_ = util::timeMilli();
+            if (client_) {
+                client_->connectedTime = util::timeMilli();
+            }
             trace("tcp connected %s - %s fd %d",
                 local_.toString().c_str(), peer_.toString().c_str(), channel_->fd());
-            if (statecb_) {
-                statecb_(con);
+            if (cbs_ && cbs_->state) {
+                cbs_->state(con);
             }
         }
     } else {
@@ -173,12 +245,15 @@ void TcpConn::handleWrite(const TcpConnPtr& con) {
     if (state_ == State::Handshaking) { //握手就处理握手
         handleHandshake(con);
     } else if (state_ == State::Connected) { //如果已经连接
-        ssize_t sended = isend(output_.begin(), output_.size());
-        output_.consume(sended);
-        if (output_.empty() && writablecb_) {
-            writablecb_(con);
+        bool edge = channel_->edgeTriggered();
+        if (edge && output_.empty() && chunks_.empty()) { //边缘触发时没有待发送的数据，忽略这次可写通知
+            return;
+        }
+        flush();
+        if (output_.empty() && chunks_.empty() && cbs_ && cbs_->writable) {
+            cbs_->writable(con);
         }
-        if (output_.empty() && channel_->writeEnabled()) { // writablecb_ may write something
+        if (!edge && output_.empty() && chunks_.empty() && channel_ && channel_->writeEnabled()) { // writable callback may write something
             channel_->enableWrite(false); //这个通道关闭写
         }
     } else {
@@ -186,6 +261,30 @@ void TcpConn::handleWrite(const TcpConnPtr& con) {
     }
 }
 
+void TcpConn::handleError(const TcpConnPtr& con) {
+    if (zc_ && state_ == State::Connected) { //零拷贝的完成通知通过错误队列送达
+        readZeroCopy();
+        if ((!chunks_.empty() || !output_.empty()) && !waitWritable()) { //ENOBUFS后等到完成通知再继续发送
+            flush();
+            if (output_.empty() && chunks_.empty() && cbs_ && cbs_->writable) {
+                cbs_->writable(con);
+            }
+        }
+        if (!channel_) {
+            return;
+        }
+    }
+    int err = 0;
+    socklen_t len = sizeof err;
+    int r = getsockopt(channel_->fd(), SOL_SOCKET, SO_ERROR, &err, &len);
+    if (r == 0 && err == 0) { //仅是对端关闭，留给读事件取走剩余数据
+        return;
+    }
+    info("tcp %s - %s fd %d error %d %s", local_.toString().c_str(), peer_.toString().c_str(),
+        channel_->fd(), r ? errno : err, strerror(r ? errno : err));
+    cleanup(con);
+}
+
 ssize_t TcpConn::isend(const char* buf, size_t len) {
     size_t sended = 0;
     while (len > sended) { //当没发送完时
@@ -209,17 +308,247 @@ ssize_t TcpConn::isend(const char* buf, size_t len) {
     return sended;
 }
 
+ssize_t TcpConn::sendfileImp(int fd, int file, int64_t offset, size_t bytes) {
+#ifdef OS_LINUX
+    off_t off = offset;
+    return ::sendfile(fd, file, &off, bytes);
+#else
+    char buf[64 * 1024]; //其他系统先读到栈上再写，一次最多64K
+    ssize_t rd = pread(file, buf, std::min(bytes, sizeof buf), offset);
+    if (rd <= 0) {
+        return rd;
+    }
+    return writeImp(fd, buf, rd);
+#endif
+}
+
+void TcpConn::flush() {
+#ifdef IOV_MAX
+    const int kMaxIov = IOV_MAX;
+#else
+    const int kMaxIov = 1024;
+#endif
+    while (!chunks_.empty()) {
+        ssize_t wd;
+        OutputChunk& front = chunks_.front();
+        if (front.isFile()) {
+            wd = sendfileImp(channel_->fd(), front.fd, front.offset, front.size());
+            trace("channel %lld fd %d sendfile %ld bytes", (long long)channel_->id(), channel_->fd(), (long)wd);
+            if (wd == 0) { //文件被截短，对端已按约定的长度接收，后续数据会错位，只能关闭连接
+                error("sendfile reached end of file: channel %lld fd %d file %d offset %lld left %lu, closing",
+                    (long long)channel_->id(), channel_->fd(), front.fd, (long long)front.offset, (unsigned long)front.size());
+                if (channel_->writeEnabled()) {
+                    channel_->enableWrite(false);
+                }
+                close();
+                return;
+            }
+        } else if (zc_ && (zc_->first >= 0 || front.size() >= zc_->threshold)) {
+            wd = sendZeroCopy();
+            if (wd > 0) {
+                continue;
+            }
+        } else {
+            struct iovec iov[kMaxIov];
+            int n = 0;
+            bool all = true;
+            for (auto& c: chunks_) {
+                if (n == kMaxIov || c.isFile() || zeroCopy(c.size())) { //文件单独用sendfile发送，大块数据单独零拷贝发送
+                    all = false;
+                    break;
+                }
+                iov[n].iov_base = (void*)c.begin();
+                iov[n++].iov_len = c.size();
+            }
+            if (all && n < kMaxIov && output_.size()) {
+                iov[n].iov_base = output_.begin();
+                iov[n++].iov_len = output_.size();
+            }
+            wd = writevImp(channel_->fd(), iov, n);
+            trace("channel %lld fd %d writev %d iov %ld bytes", (long long)channel_->id(), channel_->fd(), n, (long)wd);
+        }
+        if (wd > 0) {
+            while (wd > 0 && !chunks_.empty()) {
+                OutputChunk& c = chunks_.front();
+                size_t sz = std::min((size_t)wd, c.size());
+                c.consume(sz);
+                wd -= sz;
+                if (c.size() == 0) {
+                    chunks_.pop_front(); //借用的数据在这里调用release
+                }
+            }
+            output_.consume(wd);
+            continue;
+        } else if (wd == -1 && errno == EINTR) {
+            continue;
+        } else if (wd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!channel_->writeEnabled()) {
+                channel_->enableWrite(true);
+            }
+            return;
+        } else if (wd == -1 && errno == ENOBUFS && zc_) {
+            //零拷贝超过optmem限制，sendZeroCopy只在还有未到达的完成通知时返回ENOBUFS
+            //完成通知经错误队列送达，POLLERR总会上报，handleError中继续发送，不依赖写事件
+            //socket仍可写，水平触发下保留写事件只会空转，先关闭
+            if (!channel_->edgeTriggered() && channel_->writeEnabled()) {
+                channel_->enableWrite(false);
+            }
+            return;
+        } else {
+            error("writev error: channel %lld fd %d wd %ld %d %s", (long long)channel_->id(), channel_->fd(), (long)wd, errno, strerror(errno));
+            return;
+        }
+    }
+    if (output_.size()) { //只剩一段时不需要writev
+        output_.consume(isend(output_.begin(), output_.size()));
+    }
+}
+
+void TcpConn::pushOutput() {
+    if (output_.size()) {
+        chunks_.emplace_back(output_);
+    }
+}
+
+ssize_t TcpConn::sendZeroCopy() {
+    OutputChunk& c = chunks_.front();
+    ssize_t wd = -1;
+    errno = ENOTSUP;
+#ifdef MSG_ZEROCOPY
+    struct iovec iov;
+    iov.iov_base = (void*)c.begin();
+    iov.iov_len = c.size();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    wd = sendmsg(channel_->fd(), &msg, MSG_ZEROCOPY);
+    trace("channel %lld fd %d zerocopy %ld bytes", (long long)channel_->id(), channel_->fd(), (long)wd);
+    if (wd > 0) {
+        if (zc_->first < 0) {
+            zc_->first = zc_->next;
+        }
+        zc_->next ++;
+        zc_->stat.sends ++;
+        zc_->stat.bytes += wd;
+    } else if (wd == -1 && errno == ENOBUFS && zc_->first < 0 && zc_->pending.empty()) {
+        //超过optmem限制且没有等待中的通知，不会再有错误队列事件，改为复制发送
+        zc_->stat.fallbacks ++;
+        wd = writeImp(channel_->fd(), c.begin(), c.size());
+    }
+#endif
+    if (wd <= 0) {
+        return wd;
+    }
+    if ((size_t)wd < c.size()) {
+        c.consume(wd);
+    } else if (zc_->first < 0) {
+        chunks_.pop_front();
+    } else {
+        zc_->pending.emplace_back(zc_->first, zc_->next - 1, zc_->frontDone, std::move(c));
+        chunks_.pop_front();
+        zc_->first = -1;
+        zc_->frontDone = 0;
+    }
+    return wd;
+}
+
+void TcpConn::readZeroCopy() {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        int r = recvmsg(channel_->fd(), &msg, MSG_ERRQUEUE);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        } else if (r == -1) {
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err* se = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (se->ee_errno != 0 || se->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            //ee_info到ee_data是已完成的序号，内核计数为32位，按最近发出的序号还原
+            int64_t lo = zc_->next - (uint32_t)((uint32_t)zc_->next - se->ee_info);
+            int64_t hi = zc_->next - (uint32_t)((uint32_t)zc_->next - se->ee_data);
+            zc_->stat.completions += hi - lo + 1;
+            if (se->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc_->stat.copied += hi - lo + 1;
+            }
+            for (auto& p: zc_->pending) {
+                int64_t n = std::min(hi, p.last) - std::max(lo, p.first) + 1;
+                p.done += n > 0 ? n : 0;
+            }
+            if (zc_->first >= 0) {
+                int64_t n = std::min(hi, zc_->next - 1) - std::max(lo, zc_->first) + 1;
+                zc_->frontDone += n > 0 ? n : 0;
+            }
+        }
+    }
+    //通知可能乱序，按发送顺序释放
+    while (!zc_->pending.empty() && zc_->pending.front().done == zc_->pending.front().last - zc_->pending.front().first + 1) {
+        zc_->pending.pop_front(); //在这里调用release
+    }
+#endif
+}
+
+int TcpConn::setZeroCopy(size_t threshold) {
+    if (!channel_) {
+        return EBADF;
+    }
+    if (net::setZeroCopy(channel_->fd())) {
+        return errno;
+    }
+    if (!zc_) {
+        zc_.reset(new ZeroCopyState(threshold));
+    }
+    zc_->threshold = threshold;
+    return 0;
+}
+
+ZeroCopyStat TcpConn::zeroCopyStat() {
+    ZeroCopyStat st = ZeroCopyStat();
+    if (zc_) {
+        st = zc_->stat;
+        st.pending = zc_->pending.size();
+    }
+    return st;
+}
+
+size_t TcpConn::outputSize() {
+    size_t sz = output_.size();
+    for (auto& c: chunks_) {
+        sz += c.size();
+    }
+    return sz;
+}
+
 void TcpConn::send(Buffer& buf) {
     if (channel_) {
-        if (channel_->writeEnabled()) { //just full
-            output_.absorb(buf);   //把buf 加进来
-        }
-        if (buf.size()) {
+        if (&buf == &output_) {
+            flush();
+        } else if (!output_.empty() || !chunks_.empty() || zeroCopy(buf.size())) { //前面还有未发送的数据或需要零拷贝，整块排到队列中
+            pushOutput();
+            if (buf.size()) {
+                chunks_.emplace_back(buf);
+            }
+            if (!waitWritable()) {
+                flush();
+            }
+        } else if (buf.size()) {
             ssize_t sended = isend(buf.begin(), buf.size());
             buf.consume(sended);
-        }
-        if (buf.size()) {
             output_.absorb(buf);
+        }
+        if (!output_.empty() || !chunks_.empty()) {
             if (!channel_->writeEnabled()) {
                 channel_->enableWrite(true);
             }
@@ -232,7 +561,7 @@ void TcpConn::send(Buffer& buf) {
 
 void TcpConn::send(const char* buf, size_t len) {
     if (channel_) {
-        if (output_.empty()) {
+        if (output_.empty() && chunks_.empty()) {
             ssize_t sended = isend(buf, len);
             buf += sended;
             len -= sended;
@@ -246,10 +575,66 @@ void TcpConn::send(const char* buf, size_t len) {
     }
 }
 
+void TcpConn::sendRef(const char* buf, size_t len, Task&& release) {
+    if (!channel_ || len == 0) {
+        if (!channel_) {
+            warn("connection %s - %s closed, but still writing %lu bytes",
+                local_.toString().c_str(), peer_.toString().c_str(), len);
+        }
+        if (release) {
+            release();
+        }
+        return;
+    }
+    if (output_.empty() && chunks_.empty() && !zeroCopy(len)) {
+        ssize_t sended = isend(buf, len);
+        buf += sended;
+        len -= sended;
+        if (len == 0) {
+            if (release) {
+                release();
+            }
+            return;
+        }
+        chunks_.emplace_back(buf, len, std::move(release));
+        return;
+    }
+    pushOutput();
+    chunks_.emplace_back(buf, len, std::move(release));
+    if (!waitWritable()) {
+        flush();
+    }
+}
+
+void TcpConn::sendFile(int fd, int64_t offset, size_t len, Task&& release) {
+    if (!channel_ || len == 0) {
+        if (!channel_) {
+            warn("connection %s - %s closed, but still sending file %d %lu bytes",
+                local_.toString().c_str(), peer_.toString().c_str(), fd, len);
+        }
+        if (release) {
+            release();
+        }
+        return;
+    }
+    pushOutput();
+    chunks_.emplace_back(fd, offset, len, std::move(release));
+    if (!waitWritable()) {
+        flush();
+    }
+    if (!chunks_.empty() && !channel_->writeEnabled()) {
+        channel_->enableWrite(true);
+    }
+}
+
 void TcpConn::onMsg(CodecBase* codec, const MsgCallBack& cb) { //当有消息时
-    assert(!readcb_); //需要读函数
+    assert(!cbs_ || !cbs_->read); //需要读函数
     codec_.reset(codec);
-    onRead([cb](const TcpConnPtr& con) { //把cd传递进去
+    onRead(msgReader(cb));
+}
+
+TcpCallBack TcpConn::msgReader(const MsgCallBack& cb) {
+    return [cb](const TcpConnPtr& con) { //把cd传递进去
         int r = 1;
         while (r) {
             Slice msg;
@@ -263,7 +648,7 @@ void TcpConn::onMsg(CodecBase* codec, const MsgCallBack& cb) { //当有消息时
                 con->getInput().consume(r); //消耗掉
             }
         }
-    });
+    };
 }
 
 void TcpConn::sendMsg(Slice msg) {
@@ -274,31 +659,87 @@ void TcpConn::sendMsg(Slice msg) {
 TcpServer::TcpServer(EventBases* bases):
 base_(bases->allocBase()),
 bases_(bases),
-listen_channel_(NULL),
-createcb_([]{ return TcpConnPtr(new TcpConn); }) //tcpServer包含一个事件处理器和创建TcpConn对象的的回调函数
+perLoop_(false),
+anyAddr_(false),
+backlog_(SOMAXCONN),
+acceptBudget_(64),
+accepted_(0), acceptFailed_(0), budgetHits_(0), wakeups_(0),
+shedLimit_(0), shedNoFd_(0), pauses_(0),
+maxConns_(0),
+pauseLagUs_(0),
+conns_(new atomic<int>(0)),
+spareFd_(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+createcb_([]{ return std::make_shared<TcpConn>(); }) //tcpServer包含一个事件处理器和创建TcpConn对象的的回调函数
 {
+    updateCallBacks();
+}
+
+void TcpServer::updateCallBacks() {
+    shared_ptr<TcpCallBacks> cbs = make_shared<TcpCallBacks>();
+    cbs->read = msgcb_ ? TcpConn::msgReader(msgcb_) : readcb_;
+    cbs->state = statecb_;
+    cbs->conns = maxConns_ ? conns_ : NULL;
+    conncbs_ = cbs; //已接受的连接仍使用原来的一份
+}
+
+TcpServer::~TcpServer() {
+    for (Channel* ch: listen_channels_) {
+        delete ch;
+    }
+    if (spareFd_ >= 0) {
+        close(spareFd_);
+    }
 }
 
 int TcpServer::bind(const std::string &host, short port, bool reusePort) {
     addr_ = Ip4Addr(host, port);
+    return listenOn(base_, reusePort);
+}
+
+int TcpServer::bindPerLoop(const std::string &host, short port, bool cpuSteer) {
+    addr_ = Ip4Addr(host, port);
+    perLoop_ = true;
+    for (int i = 0; i < bases_->size(); i ++) {
+        int r = listenOn(bases_->getBase(i), true);
+        if (r) {
+            return r;
+        }
+    }
+    int lfd = listen_channels_[0]->fd();
+    if (cpuSteer && bases_->size() > 1 && net::setReusePortCpuSteer(lfd, bases_->size())) {
+        warn("attach reuseport cpu steering on fd %d failed %d %s", lfd, errno, strerror(errno));
+    }
+    return 0;
+}
+
+int TcpServer::listenOn(EventBase* base, bool reusePort) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     int r = net::setReuseAddr(fd);
     fatalif(r, "set socket reuse option failed");
     r = net::setReusePort(fd, reusePort);
     fatalif(r, "set socket reuse port option failed");
+    if (reusePort && base->cpu() >= 0 && net::setIncomingCpu(fd, base->cpu())) { //与绑定了cpu的事件循环配对
+        warn("set SO_INCOMING_CPU %d on fd %d failed %d %s", base->cpu(), fd, errno, strerror(errno));
+    }
     r = util::addFdFlag(fd, FD_CLOEXEC);
     fatalif(r, "addFdFlag FD_CLOEXEC failed");
     r = ::bind(fd,(struct sockaddr *)&addr_.getAddr(),sizeof(struct sockaddr)); //TcpServer绑在什么口上
     if (r) {
+        r = errno;
         close(fd);
-        error("bind to %s failed %d %s", addr_.toString().c_str(), errno, strerror(errno));
-        return errno;
+        error("bind to %s failed %d %s", addr_.toString().c_str(), r, strerror(r));
+        return r;
     }
-    r = listen(fd, 20);
+    r = listen(fd, backlog_);
     fatalif(r, "listen failed %d %s", errno, strerror(errno));
-    info("fd %d listening at %s", fd, addr_.toString().c_str());
-    listen_channel_ = new Channel(base_, fd, kReadEvent); //bind时会新建一个频道
-    listen_channel_->onRead([this]{ handleAccept(); }); //当频道上有数据可读时，处理接收事件
+    socklen_t alen = sizeof(struct sockaddr_in);
+    r = getsockname(fd, (struct sockaddr*)&addr_.getAddr(), &alen); //端口为0时取得实际端口
+    fatalif(r, "getsockname failed %d %s", errno, strerror(errno));
+    anyAddr_ = addr_.getAddr().sin_addr.s_addr == htonl(INADDR_ANY);
+    info("fd %d listening at %s backlog %d", fd, addr_.toString().c_str(), backlog_);
+    Channel* ch = new Channel(base, fd, kReadEvent); //bind时会新建一个频道
+    ch->onRead([this, ch]{ handleAccept(ch); }); //当频道上有数据可读时，处理接收事件
+    listen_channels_.push_back(ch);
     return 0;
 }
 
@@ -312,48 +753,170 @@ TcpServerPtr TcpServer::startServer(EventBases* bases, const std::string& host,
     return r == 0 ? p : NULL;
 }
 
-void TcpServer::handleAccept() { //处理接收
-    struct sockaddr_in raddr;
-    socklen_t rsz = sizeof(raddr);
-    int lfd = listen_channel_->fd();
-    int cfd;
-    while (lfd >= 0 && (cfd = accept(lfd,(struct sockaddr *)&raddr,&rsz))>=0) { //有连接上来
-        sockaddr_in peer, local;
+TcpServerPtr TcpServer::startPerLoopServer(EventBases* bases, const std::string& host, short port, bool cpuSteer) {
+    TcpServerPtr p(new TcpServer(bases));
+    int r = p->bindPerLoop(host, port, cpuSteer);
+    if (r) {
+        error("bind to %s:%d failed %d %s", host.c_str(), port, r, strerror(r));
+    }
+    return r == 0 ? p : NULL;
+}
+
+AcceptStat TcpServer::acceptStat() {
+    AcceptStat st;
+    st.accepted = accepted_.load(memory_order_relaxed);
+    st.failed = acceptFailed_.load(memory_order_relaxed);
+    st.budgetHits = budgetHits_.load(memory_order_relaxed);
+    st.wakeups = wakeups_.load(memory_order_relaxed);
+    st.shedLimit = shedLimit_.load(memory_order_relaxed);
+    st.shedNoFd = shedNoFd_.load(memory_order_relaxed);
+    st.pauses = pauses_.load(memory_order_relaxed);
+    return st;
+}
+
+int TcpServer::shedNoFd(int lfd) {
+    lock_guard<mutex> lk(spareMutex_);
+    if (spareFd_ < 0) {
+        spareFd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (spareFd_ < 0) {
+            return -1;
+        }
+    }
+    close(spareFd_);
+    int cfd = accept(lfd, NULL, NULL);
+    int err = errno;
+    if (cfd >= 0) {
+        close(cfd);
+        shedNoFd_.fetch_add(1, memory_order_relaxed);
+    }
+    spareFd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (cfd >= 0) {
+        return 1;
+    }
+    errno = err;
+    return err == EAGAIN || err == EWOULDBLOCK ? 0 : -1;
+}
+
+//ms毫秒后恢复监听，untilCalm为true时循环延迟降到lagUs一半以下才恢复，否则继续等待
+static void resumeListen(weak_ptr<atomic<int>> alive, Channel* listen, int ms, bool untilCalm, int64_t lagUs) {
+    listen->getBase()->runAfter(ms, [=] {
+        if (alive.expired()) { //服务器已析构，通道已删除
+            return;
+        }
+        if (untilCalm && listen->getBase()->loopLagUs() * 2 > lagUs) {
+            resumeListen(alive, listen, ms, untilCalm, lagUs);
+            return;
+        }
+        listen->enableRead(true);
+    });
+}
+
+void TcpServer::pauseListen(Channel* listen, int ms, bool untilCalm) {
+    pauses_.fetch_add(1, memory_order_relaxed);
+    listen->enableRead(false);
+    resumeListen(conns_, listen, ms, untilCalm, pauseLagUs_);
+}
+
+void TcpServer::handleAccept(Channel* listen) { //处理接收
+    int lfd = listen->fd();
+    int n = 0;
+    wakeups_.fetch_add(1, memory_order_relaxed);
+    if (pauseLagUs_ && listen->getBase()->loopLagUs() > pauseLagUs_) {
+        pauseListen(listen, 10, true);
+        return;
+    }
+    while (lfd >= 0 && n < acceptBudget_) {
+        struct sockaddr_in peer, local;
         socklen_t alen = sizeof(peer);
-        int r = getpeername(cfd, (sockaddr*)&peer, &alen);
-        if (r < 0) {
-            error("get peer name failed %d %s", errno, strerror(errno));
-            continue;
+#ifdef OS_LINUX
+        //一次系统调用得到对端地址、非阻塞与FD_CLOEXEC
+        int cfd = accept4(lfd, (struct sockaddr *)&peer, &alen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        bool nonBlocked = true;
+#else
+        int cfd = accept(lfd, (struct sockaddr *)&peer, &alen);
+        bool nonBlocked = false;
+        if (cfd >= 0) {
+            int r = util::addFdFlag(cfd, FD_CLOEXEC);
+            fatalif(r, "addFdFlag FD_CLOEXEC failed");
         }
-        r = getsockname(cfd, (sockaddr*)&local, &alen);
-        if (r < 0) {
-            error("getsockname failed %d %s", errno, strerror(errno));
+#endif
+        if (cfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                int r = shedNoFd(lfd);
+                if (r > 0) {
+                    continue;
+                } else if (r < 0) { //连备用fd都没有了，停一会再accept，不在错误中空转
+                    acceptFailed_.fetch_add(1, memory_order_relaxed);
+                    warn("accept failed %d %s, pause listening fd %d", errno, strerror(errno), lfd);
+                    pauseListen(listen, 100, false);
+                }
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                acceptFailed_.fetch_add(1, memory_order_relaxed);
+                warn("accept return %d  %d %s", cfd, errno, strerror(errno));
+            }
+            return;
+        }
+        n ++;
+        if (anyAddr_) { //监听在任意地址上时本端地址取决于连接
+            alen = sizeof(local);
+            if (getsockname(cfd, (sockaddr*)&local, &alen) < 0) {
+                error("getsockname failed %d %s", errno, strerror(errno));
+                close(cfd);
+                continue;
+            }
+        } else {
+            local = addr_.getAddr();
+        }
+        accepted_.fetch_add(1, memory_order_relaxed);
+        EventBase* b = listen->getBase();
+        if (perLoop_) {
+            b->reserveConn(); //连接留在本循环
+        } else {
+            b = bases_->allocBase(peer); //按分配策略选择事件处理器
+        }
+        if ((maxConns_ && *conns_ >= maxConns_) || (b->maxConns() && b->connCount() > b->maxConns())) {
+            b->releaseConn(); //超过上限，接受后立即关闭，不让连接在backlog中超时
+            close(cfd);
+            shedLimit_.fetch_add(1, memory_order_relaxed);
             continue;
         }
-        r = util::addFdFlag(cfd, FD_CLOEXEC);
-        fatalif(r, "addFdFlag FD_CLOEXEC failed");
-        EventBase* b = bases_->allocBase(); //初始化事件处理器
+        shared_ptr<atomic<int>> conns;
+        if (maxConns_) {
+            conns = conns_;
+            (*conns) ++;
+        }
         auto addcon = [=] {
             TcpConnPtr con = createcb_();
-            con->attach(b, cfd, local, peer);
-            if (statecb_) {
-                con->onState(statecb_);
+            con->attach(b, cfd, local, peer, nonBlocked);
+            if (msgcb_) {
+                con->codec_.reset(codec_->clone());
             }
-            if (readcb_) {
-                con->onRead(readcb_);
+            if (!con->cbs_) {
+                con->cbs_ = conncbs_; //共享服务器的回调，不逐个复制
+            } else { //onConnCreate中已设置了回调，合并到连接自己的一份上
+                TcpCallBacks& cbs = con->callBacks();
+                if (conncbs_->read) {
+                    cbs.read = conncbs_->read;
+                }
+                if (statecb_) {
+                    cbs.state = statecb_;
+                }
             }
-            if (msgcb_) {
-                con->onMsg(codec_->clone(), msgcb_);
+            if (con->cbs_->conns != conns) { //回调生成后又修改了连接数上限，按接受时是否计数为准
+                con->callBacks().conns = conns;
             }
         };
-        if (b == base_) {
+        if (b == listen->getBase()) {
             addcon(); //已经有事件处理器了，直接加上处理函数
         } else {
             b->safeCall(move(addcon)); //事件处理器调用添加事件处理函数
         }
     }
-    if (lfd >= 0 && errno != EAGAIN && errno != EINTR) {
-        warn("accept return %d  %d %s", cfd, errno, strerror(errno));
+    if (n >= acceptBudget_) { //监听socket为水平触发，剩余的连接下一轮继续accept
+        budgetHits_.fetch_add(1, memory_order_relaxed);
     }
 }
 
@@ -1,8 +1,84 @@
 #pragma once
 #include "event_base.h"
+#include <deque>
+#include <list>
+#include <sys/uio.h>
 
 namespace handy {
 
+//输出队列中的一段数据：自有的Buffer、借用的内存或者文件的一段
+//借用的内存与文件发送完或连接关闭时调用release
+    struct OutputChunk: private noncopyable {
+        Buffer buf;
+        const char* data;   //借用的数据，为NULL时使用buf或文件
+        size_t len;
+        int fd;             //文件，-1表示不是文件
+        int64_t offset;     //文件中下一个待发送的位置
+        Task release;
+        OutputChunk(Buffer& b): data(NULL), len(0), fd(-1), offset(0) { buf.absorb(b); } //交换，不复制
+        OutputChunk(const char* d, size_t l, Task&& r): data(d), len(l), fd(-1), offset(0), release(std::move(r)) {}
+        OutputChunk(int f, int64_t off, size_t l, Task&& r): data(NULL), len(l), fd(f), offset(off), release(std::move(r)) {}
+        OutputChunk(OutputChunk&& c): data(c.data), len(c.len), fd(c.fd), offset(c.offset), release(std::move(c.release)) {
+            buf.absorb(c.buf);
+            c.release = nullptr;
+        }
+        ~OutputChunk() { if (release) release(); }
+        bool isFile() const { return fd >= 0; }
+        const char* begin() const { return data ? data : buf.data(); }
+        size_t size() const { return data || fd >= 0 ? len : buf.size(); }
+        void consume(size_t n) {
+            if (fd >= 0) {
+                offset += n;
+                len -= n;
+            } else if (data) {
+                data += n;
+                len -= n;
+            } else {
+                buf.consume(n);
+            }
+        }
+    };
+
+//MSG_ZEROCOPY发送的统计
+    struct ZeroCopyStat {
+        int64_t sends;        //带MSG_ZEROCOPY的sendmsg成功次数，每次对应一个完成通知序号
+        int64_t bytes;        //以零拷贝方式发出的字节数
+        int64_t completions;  //已收到完成通知的发送次数
+        int64_t copied;       //内核仍然做了复制的发送次数，loopback或网卡不支持分散聚合时出现
+        int64_t fallbacks;    //ENOBUFS时改为普通write的次数
+        int64_t pending;      //已发出、等待完成通知后才释放的数据段数
+    };
+
+//零拷贝发送的状态，数据段发完后移入pending，内核通知完成后才释放
+    struct ZeroCopyState {
+        struct Pending {
+            int64_t first, last, done; //占用的序号范围与其中已完成的个数
+            OutputChunk chunk;
+            Pending(int64_t f, int64_t l, int64_t d, OutputChunk&& c): first(f), last(l), done(d), chunk(std::move(c)) {}
+        };
+        size_t threshold;   //不小于此长度的数据段使用零拷贝
+        int64_t next;       //下一次发送的序号，内核的计数为32位，这里不回绕
+        int64_t first;      //队首数据段第一次零拷贝发送的序号，-1表示没有
+        int64_t frontDone;  //队首数据段已完成的发送次数
+        std::deque<Pending> pending;
+        ZeroCopyStat stat;
+        ZeroCopyState(size_t t): threshold(t), next(0), first(-1), frontDone(0), stat() {}
+    };
+
+//连接的读、可写、状态回调，TcpServer接受的连接共享服务器的一份，连接单独设置时先复制
+    struct TcpCallBacks {
+        TcpCallBack read, writable, state;
+        std::shared_ptr<std::atomic<int>> conns; //所属服务器设置了连接数上限时的连接计数，连接清除时减少
+    };
+
+//客户端连接的目标与重连信息，服务端接受的连接没有
+    struct TcpClientInfo {
+        std::string destHost, localIp;  //目标主机和本地IP
+        int destPort, connectTimeout, reconnectInterval; //目标端口，连接超时，重连间隔
+        int64_t connectedTime;          //最近一次连接的时间
+        TcpClientInfo(): destPort(-1), connectTimeout(0), reconnectInterval(-1), connectedTime(0) {}
+    };
+
 //Tcp连接，使用引用计数
     struct TcpConn: public std::enable_shared_from_this<TcpConn>, private noncopyable {
         //Tcp连接的个状态
@@ -20,7 +96,7 @@ namespace handy {
             TcpConnPtr con(new C); con->attach(base, fd, local, peer); return con;
         }
 
-        bool isClient() { return destPort_ > 0; }
+        bool isClient() { return client_ && client_->destPort > 0; }
         //automatically managed context. allocated when first used, deleted when destruct
         template<class T> T& context() { return ctx_.context<T>(); }
 
@@ -30,22 +106,36 @@ namespace handy {
         Buffer& getInput() { return input_; }   //获得输入缓冲区
         Buffer& getOutput() { return output_; } //获得输出缓冲区
 
-        Channel* getChannel() { return channel_; }  //获得Channel
+        Channel* getChannel() { return channel_; }  //channel嵌在连接中，连接关闭后为NULL  //获得Channel
         bool writable() { return channel_ ? channel_->writeEnabled(): false; }
 
-        //发送数据
+        //发送数据，未发送完的数据依次排在输出队列中，与之前的数据一起用writev发出
         void sendOutput() { send(output_); }
+        //msg的内容被移入输出队列，不复制
         void send(Buffer& msg);
         void send(const char* buf, size_t len);
         void send(const std::string& s) { send(s.data(), s.size()); }
         void send(const char* s) { send(s, strlen(s)); }
+        //发送借用的内存，不复制，数据发送完或连接关闭时调用release，之前buf必须有效
+        void sendRef(const char* buf, size_t len, Task&& release);
+        //发送文件fd中从offset开始的len字节，linux下用sendfile，文件内容不进入用户态
+        //socket缓冲区满时等待可写后继续，全部发送后回调onWritable；发送完或连接关闭时调用release，之前fd必须有效
+        void sendFile(int fd, int64_t offset, size_t len, Task&& release);
+        //输出队列中尚未发送的字节数
+        size_t outputSize();
+        //对不小于threshold字节的send(Buffer&)、sendRef数据段使用MSG_ZEROCOPY，数据由网卡直接从用户内存读取
+        //数据段在内核通知完成后才释放（调用release），因此借用的内存要比普通发送保持得更久
+        //小块数据的完成通知开销高于复制，threshold一般不小于10K；重载了writeImp的子类（如ssl）不能使用
+        //需在连接建立后调用，return 0 on success, errno on error
+        int setZeroCopy(size_t threshold=16*1024);
+        ZeroCopyStat zeroCopyStat();
 
         //数据到达时回调
-        void onRead(const TcpCallBack& cb) { assert(!readcb_); readcb_ = cb; };
+        void onRead(const TcpCallBack& cb) { assert(!cbs_ || !cbs_->read); callBacks().read = cb; };
         //当tcp缓冲区可写时回调
-        void onWritable(const TcpCallBack& cb) { writablecb_ = cb;}
+        void onWritable(const TcpCallBack& cb) { callBacks().writable = cb;}
         //tcp状态改变时回调
-        void onState(const TcpCallBack& cb) { statecb_ = cb; }
+        void onState(const TcpCallBack& cb) { callBacks().state = cb; }
         //tcp空闲回调
         void addIdleCB(int idle, const TcpCallBack& cb);  //TCP空闲回调
 
@@ -58,7 +148,7 @@ namespace handy {
         //conn会在下个事件周期进行处理
         void close();
         //设置重连时间间隔，-1: 不重连，0:立即重连，其它：等待毫秒数，未设置不重连
-        void setReconnectInterval(int milli) { reconnectInterval_ = milli; }
+        void setReconnectInterval(int milli) { clientInfo().reconnectInterval = milli; }
 
         //!慎用。立即关闭连接，清理相关资源，可能导致该连接的引用计数变为0，从而使当前调用者引用的连接被析构
         void closeNow() { if (channel_) channel_->close(); }
@@ -68,54 +158,118 @@ namespace handy {
 
     public:
         EventBase* base_;                 //事件处理器
-        Channel* channel_;                //连接频道
-        Buffer input_, output_;           //输入输出buffer
+        Channel* channel_;                //连接频道，指向channelBuf_，未连接或已关闭时为NULL
+        Buffer input_, output_;           //输入输出buffer，output_排在chunks_之后
+        std::list<OutputChunk> chunks_;   //排在output_之前待发送的数据段，空的deque也要分配约600字节，这里用list
         Ip4Addr local_, peer_;            //本端，对端
         State state_;                     //状态
-        TcpCallBack readcb_, writablecb_, statecb_;     //读，写，状态的回调函数
+        std::shared_ptr<TcpCallBacks> cbs_; //读，写，状态的回调函数，可能与同一服务器的其他连接共享
         std::list<IdleId> idleIds_;       //what's this
         TimerId timeoutId_;               //定时器
         AutoContext ctx_, internalCtx_;   //一些自动生成的内容
-        std::string destHost_, localIp_;  //字符串，目标主机和本地IP
-        int destPort_, connectTimeout_, reconnectInterval_; //目标端口，连接超时，重连间隔
-        int64_t connectedTime_;           //已连接时间
+        std::unique_ptr<TcpClientInfo> client_; //客户端连接的目标与重连信息
         std::unique_ptr<CodecBase> codec_;    //解码器指针
+        std::unique_ptr<ZeroCopyState> zc_;   //零拷贝发送，未开启时为空
+        TcpConnPtr self_;                 //channel打开期间持有自己，channel的回调只保存this
+        alignas(Channel) char channelBuf_[sizeof(Channel)]; //channel嵌在连接中，省去一次分配
+        //本连接的回调，与其他连接共享时先复制一份
+        TcpCallBacks& callBacks();
+        TcpClientInfo& clientInfo() { if (!client_) client_.reset(new TcpClientInfo); return *client_; }
+        //onMsg的读回调，按codec_解出消息后调用cb
+        static TcpCallBack msgReader(const MsgCallBack& cb);
+        void closeChannel(); //析构嵌入的channel，关闭fd
         void handleRead(const TcpConnPtr& con); //处理读事件
         void handleWrite(const TcpConnPtr& con);  //处理写事件
+        void handleError(const TcpConnPtr& con);  //处理错误事件
         ssize_t isend(const char* buf, size_t len); //发送了多少内容，并发送
+        void flush(); //用writev与sendfile发送chunks_与output_，直到发完或EAGAIN
+        void pushOutput(); //把output_移入chunks_末尾，之后追加的数据段排在其后
+        bool zeroCopy(size_t len) { return zc_ && len >= zc_->threshold; }
+        ssize_t sendZeroCopy(); //用MSG_ZEROCOPY发送队首数据段，返回值同write
+        void readZeroCopy();  //从错误队列中读取完成通知，释放已完成的数据段
+        //水平触发下已在等待可写事件，说明上次写入遇到了EAGAIN，此时不必再尝试写
+        bool waitWritable() { return channel_->writeEnabled() && !channel_->edgeTriggered(); }
         void cleanup(const TcpConnPtr& con);  //清除连接
         void connect(EventBase* base, const std::string& host, short port, int timeout, const std::string& localip);  //连接，配套事件处理器
         void reconnect(); //重联
-        void attach(EventBase* base, int fd, Ip4Addr local, Ip4Addr peer); //把事件处理器加到连接
+        //nonBlocked为true表示fd已经是非阻塞的
+        void attach(EventBase* base, int fd, Ip4Addr local, Ip4Addr peer, bool nonBlocked=false); //把事件处理器加到连接
         virtual int readImp(int fd, void* buf, size_t bytes) { return ::read(fd, buf, bytes); }  //读写
+        //handleRead读到input_末尾与栈上的备用区，重载了readImp的子类（如ssl）需同时重载此函数
+        virtual ssize_t readvImp(int fd, const struct iovec* iov, int cnt) { return ::readv(fd, iov, cnt); }
         virtual int writeImp(int fd, const void* buf, size_t bytes) { return ::write(fd, buf, bytes); }
+        //输出队列有多段数据时使用，重载了writeImp的子类（如ssl）需同时重载此函数
+        virtual ssize_t writevImp(int fd, const struct iovec* iov, int cnt) { return ::writev(fd, iov, cnt); }
+        //把文件file中offset开始的最多bytes字节写到fd，重载了writeImp的子类需同时重载此函数
+        virtual ssize_t sendfileImp(int fd, int file, int64_t offset, size_t bytes);
         virtual int handleHandshake(const TcpConnPtr& con);   //处理握手
     };
 
+    //TcpServer的accept统计
+    struct AcceptStat {
+        int64_t accepted;     //接受的连接数
+        int64_t failed;       //accept失败的次数，不含EAGAIN
+        int64_t budgetHits;   //一次可读中accept数达到上限的次数
+        int64_t wakeups;      //监听socket可读的次数，accepted / wakeups为平均每次accept的连接数
+        int64_t shedLimit;    //超过连接数上限被立即关闭的连接数
+        int64_t shedNoFd;     //fd耗尽时借助备用fd接受后关闭的连接数
+        int64_t pauses;       //暂停监听的次数，包括循环延迟过高与fd耗尽
+    };
+
 //Tcp服务器
     struct TcpServer: private noncopyable {
         TcpServer(EventBases* bases); //方便指针的使用？
         //return 0 on sucess, errno on error
         int bind(const std::string& host, short port, bool reusePort=false);   //绑在端口上
         static TcpServerPtr startServer(EventBases* bases, const std::string& host, short port, bool reusePort=false);
-        ~TcpServer() { delete listen_channel_; } //tcpserver析沟时只需要把频道删掉
+        //每个EventBase各开一个reuseport监听socket，在本循环中accept，连接不再跨线程转交，需在loop之前调用
+        //cpuSteer为true时挂上cBPF程序，让cpu i上收到的连接交给第i % size()个循环，配合MultiBase::setAffinity使用
+        int bindPerLoop(const std::string& host, short port, bool cpuSteer=false);
+        static TcpServerPtr startPerLoopServer(EventBases* bases, const std::string& host, short port, bool cpuSteer=false);
+        ~TcpServer(); //tcpserver析沟时只需要把频道删掉
+        //listen的backlog，默认SOMAXCONN，实际值受net.core.somaxconn限制，需在bind之前设置
+        void setBacklog(int backlog) { backlog_ = backlog; }
+        //每次监听socket可读时最多accept的连接数，剩余的留到下一轮，避免连接风暴时饿死其他通道
+        void setAcceptBudget(int budget) { acceptBudget_ = budget; }
+        //本服务器的最大连接数，0不限制，超过时接受后立即关闭
+        //连接数在连接清除时减少，连接自己用onState替换状态回调不影响计数
+        void setMaxConns(int maxConns) { maxConns_ = maxConns; updateCallBacks(); }
+        int connCount() { return *conns_; }
+        //监听所在循环的延迟（EventBase::loopLagUs）超过lagUs时暂停accept，降到一半以下时恢复，0不暂停
+        //暂停期间新连接留在内核的backlog中
+        void setPauseOnLag(int lagUs) { pauseLagUs_ = lagUs; }
+        AcceptStat acceptStat();
         Ip4Addr getAddr() { return addr_; }
         EventBase* getBase() { return base_; }
         void onConnCreate(const std::function<TcpConnPtr()>& cb) { createcb_ = cb; }
-        void onConnState(const TcpCallBack& cb) { statecb_ = cb; }
-        void onConnRead(const TcpCallBack& cb) { readcb_ = cb; assert(!msgcb_); }
+        void onConnState(const TcpCallBack& cb) { statecb_ = cb; updateCallBacks(); }
+        void onConnRead(const TcpCallBack& cb) { readcb_ = cb; assert(!msgcb_); updateCallBacks(); }
         // 消息处理与Read回调冲突，只能调用一个
-        void onConnMsg(CodecBase* codec, const MsgCallBack& cb) { codec_.reset(codec); msgcb_ = cb; assert(!readcb_); }
+        void onConnMsg(CodecBase* codec, const MsgCallBack& cb) { codec_.reset(codec); msgcb_ = cb; assert(!readcb_); updateCallBacks(); }
     private:
         EventBase* base_;  //事件相关处理
         EventBases* bases_; //EventBase的基类
         Ip4Addr addr_;  //地址
-        Channel* listen_channel_; //channel
+        std::vector<Channel*> listen_channels_; //监听的channel，每个循环各自监听时每个EventBase一个
+        bool perLoop_; //每个循环各自监听，连接留在accept它的循环中
+        bool anyAddr_; //监听在0.0.0.0上，连接的本端地址需要逐个获取
+        int backlog_, acceptBudget_;
+        std::atomic<int64_t> accepted_, acceptFailed_, budgetHits_, wakeups_; //可能被多个循环同时更新
+        std::atomic<int64_t> shedLimit_, shedNoFd_, pauses_;
+        int maxConns_, pauseLagUs_;
+        std::shared_ptr<std::atomic<int>> conns_; //本服务器的连接数，定时器持有其weak_ptr判断服务器是否已析构
+        int spareFd_; //预留的fd，fd耗尽时关闭它来接受并关闭一个连接，避免监听socket一直可读
+        std::mutex spareMutex_;
         TcpCallBack statecb_, readcb_;  //状态改变回调函数等
         MsgCallBack msgcb_; //消息到了的回调函数
         std::function<TcpConnPtr()> createcb_;  //createcb_指向一个创建TcpConn的构造函数
         std::unique_ptr<CodecBase> codec_; //一个解码器
-        void handleAccept(); //处理接受连接
+        std::shared_ptr<TcpCallBacks> conncbs_; //由上面的回调生成，所有接受的连接共享，不再逐个复制
+        void updateCallBacks(); //回调或连接数上限改变后重新生成conncbs_
+        int listenOn(EventBase* base, bool reusePort); //在base上新建一个监听channel
+        void handleAccept(Channel* listen); //处理接受连接
+        int shedNoFd(int lfd); //fd耗尽时用备用fd接受并关闭一个连接，返回1，没有待接受的连接返回0，失败返回-1
+        void pauseListen(Channel* listen, int ms, bool untilCalm); //暂停监听ms毫秒，untilCalm为true时到期后循环延迟降下来才恢复
     };
 
     typedef std::function<std::string (const TcpConnPtr&, const std::string& msg)> RetMsgCallBack;
@@ -2,23 +2,22 @@
 #include "logging.h"
 #include "util.h"
 #include <map>
+#include <algorithm>
+#include <limits>
 #include <string.h>
 #include <fcntl.h>
 #include "poller.h"
 #include "conn.h"
+#include "timer_wheel.h"
+#ifdef OS_LINUX
+#include <sys/eventfd.h>
+#endif
 using namespace std;
 
 namespace handy {
 
 namespace {
 
-struct TimerRepeatable {     //可重复执行的任务
-    int64_t at; //current timer timeout timestamp， timeout at at
-    int64_t interval;   //重复间隔
-    TimerId timerid;    //定时器，时间对
-    Task cb;            //任务函数
-};
-
 struct IdleNode {      //空节点，就是一个连接和他的执行函数
     TcpConnPtr con_;   //连接指针
     int64_t updated_;  //更新时间
@@ -39,18 +38,28 @@ struct EventsImp {
     EventBase* base_;  //指向包含自己的父类EventBase
     PollerBase* poller_;
     std::atomic<bool> exit_;   //是否退出
-    int wakeupFds_[2];    //唤醒管道fd
+    int wakeupFds_[2];    //唤醒用的fd，linux下为同一个eventfd，其他系统为管道的读写两端
     int nextTimeout_;     //下次超时
-    SafeQueue<Task> tasks_;   //任务函数队列
+    MpscQueue<Task> tasks_;   //任务函数队列，其他线程无锁写入
+    std::atomic<bool> wakeupPending_; //已写入唤醒且尚未被事件循环取走，期间的safeCall不再重复唤醒
 
-    std::map<TimerId, TimerRepeatable> timerReps_;   //定时器id对可重复任务map
-    std::map<TimerId, Task> timers_;                //定时器id对任务map
-    std::atomic<int64_t> timerSeq_;                 //定时器序列
+    std::unique_ptr<TimerWheel> timers_;            //分层时间轮，存放一次性与重复任务
     std::map<int, std::list<IdleNode>> idleConns_;  //空闲时间 idleNode list的 map
     std::set<TcpConnPtr> reconnectConns_;           //tcp连接指针 set
     bool idleEnabled;                               //启用空
-
-    EventsImp(EventBase* base, int taskCap);        //Event和任务上限
+    bool edgeTrigger_;                              //新连接是否使用边缘触发
+    int busyPollUs_;                                //新连接的SO_BUSY_POLL
+    int cpu_;                                       //事件循环线程绑定的cpu，-1不绑定
+    int spinMax_;                                   //自旋预算上限，0为不自旋
+    std::atomic<int> spinBudget_;                   //当前自旋预算
+    std::atomic<int64_t> spinUs_, blockUs_, spinHits_, blocks_;  //运行统计，只在事件循环线程中写
+    LoopMetrics metrics_;                           //直方图指标，只在事件循环线程中写
+    std::atomic<int> conns_, pendingConns_;         //已attach的连接数，已分配尚未attach的连接数
+    int maxConns_;                                  //连接数上限，0不限制
+    std::atomic<int64_t> lagUs_;                    //每轮循环处理时间的平滑值
+    std::vector<Task> endTasks_;                    //本轮处理完后执行的任务，只在事件循环线程访问
+
+    EventsImp(EventBase* base, int taskCap, int spinUs); //Event和任务上限，自旋预算
     ~EventsImp();
     void init();                                    //初始化
     void callIdles();                               //调用空闲任务
@@ -58,27 +67,52 @@ struct EventsImp {
     void unregisterIdle(const IdleId& id);          //取消注册
     void updateIdle(const IdleId& id);              //更新注册
     void handleTimeouts();                          //处理超时
-    void refreshNearest(const TimerId* tid=NULL);   //刷新最近的结点
-    void repeatableTimeout(TimerRepeatable* tr);    //重复任务超时
+    void refreshNearest();                          //刷新最近的超时时间
+    bool spin();                                    //自旋等待事件，等到返回true
+    void adaptSpin(int64_t idleUs);                 //根据空闲时长调整自旋预算
+    void record(int64_t start, bool blocked);       //记录一次poller调用的统计，start为调用前的时间
+    void runEndTasks() {                            //执行期间新加入的任务也在本轮执行
+        while (!endTasks_.empty()) {
+            std::vector<Task> tasks;
+            tasks.swap(endTasks_);
+            for (auto& t: tasks) {
+                t();
+            }
+        }
+    }
 
     //eventbase functions
     EventBase& exit() {exit_ = true; wakeup(); return *base_;} //置个退出标志，wakeup，返回base_
     bool exited() { return exit_; }   //检测是否需要退出
-    void safeCall(Task&& task) { tasks_.push(move(task)); wakeup(); } //函数队列里加一个函数
+    void safeCall(Task&& task) { //函数队列里加一个函数，只有事件循环可能未察觉时才唤醒
+        if (tasks_.push(move(task)) && !wakeupPending_.exchange(true, std::memory_order_acq_rel)) {
+            wakeup();
+        }
+    }
     void loop();                      //循环
     //处理已到期的事件,waitMs表示若无当前需要处理的任务，需要等待的时间
-    void loop_once(int waitMs) { poller_->loop_once(std::min(waitMs, nextTimeout_)); handleTimeouts(); }
-    void wakeup() {  //往管道里写个1
-        int r = write(wakeupFds_[1], "", 1);
-        fatalif(r<=0, "write error wd %d %d %s", r, errno, strerror(errno));
+    void loop_once(int waitMs) {
+        int wait = std::min(waitMs, nextTimeout_);
+        int64_t start = util::timeMicro();
+        poller_->loop_once(wait);
+        handleTimeouts();
+        runEndTasks();
+        record(start, wait != 0);
     }
+    void wakeup() {  //eventfd计数加1，多次唤醒自动合并，不会阻塞
+        uint64_t one = 1;
+        int r = write(wakeupFds_[1], &one, wakeupFds_[0] == wakeupFds_[1] ? sizeof one : 1);
+        //管道写满时已经可读，忽略EAGAIN
+        fatalif(r<=0 && errno != EAGAIN && errno != EINTR, "write error wd %d %d %s", r, errno, strerror(errno));
+    }
+    static const int kTaskBatch = 1024; //每次唤醒最多执行的任务数，剩余的留到下一轮，避免饿死io
 
     bool cancel(TimerId timerid); //取消一个时间对应的任务
     TimerId runAt(int64_t milli, Task&& task, int64_t interval);  //task运行
 };
 
-EventBase::EventBase(int taskCapacity) {   //初始化EventBase，初始化 _imp
-    imp_.reset(new EventsImp(this, taskCapacity)); //_imp里的base_指针指向this
+EventBase::EventBase(int taskCapacity, int spinUs) {   //初始化EventBase，初始化 _imp
+    imp_.reset(new EventsImp(this, taskCapacity, spinUs)); //_imp里的base_指针指向this
     imp_->init();
 }
 
@@ -96,23 +130,88 @@ void EventBase::loop() { imp_->loop(); }
 
 void EventBase::loop_once(int waitMs) { imp_->loop_once(waitMs); }
 
+EventBase& EventBase::setEdgeTrigger(bool edge) { imp_->edgeTrigger_ = edge; return *this; }
+
+bool EventBase::edgeTrigger() { return imp_->edgeTrigger_; }
+
+EventBase& EventBase::setBusyPoll(int usec) { imp_->busyPollUs_ = usec; return *this; }
+
+int EventBase::busyPoll() { return imp_->busyPollUs_; }
+
+void EventBase::atLoopEnd(Task&& task) { imp_->endTasks_.push_back(move(task)); }
+
+EventBase& EventBase::setCpu(int cpu) { imp_->cpu_ = cpu; return *this; }
+
+int EventBase::cpu() { return imp_->cpu_; }
+
+const LoopMetrics& EventBase::loopMetrics() { return imp_->metrics_; }
+
+int EventBase::connCount() { return imp_->conns_ + imp_->pendingConns_; }
+
+void EventBase::reserveConn() { imp_->pendingConns_ ++; }
+
+void EventBase::releaseConn() {
+    int pending = imp_->pendingConns_;
+    while (pending > 0 && !imp_->pendingConns_.compare_exchange_weak(pending, pending - 1)) {
+    }
+}
+
+EventBase& EventBase::setMaxConns(int maxConns) { imp_->maxConns_ = maxConns; return *this; }
+
+int EventBase::maxConns() { return imp_->maxConns_; }
+
+int64_t EventBase::loopLagUs() { return imp_->lagUs_.load(std::memory_order_relaxed); }
+
+LoopStat EventBase::loopStat() {
+    LoopStat st;
+    st.spinUs = imp_->spinUs_.load(std::memory_order_relaxed);
+    st.blockUs = imp_->blockUs_.load(std::memory_order_relaxed);
+    st.spinHits = imp_->spinHits_.load(std::memory_order_relaxed);
+    st.blocks = imp_->blocks_.load(std::memory_order_relaxed);
+    st.spinBudgetUs = imp_->spinBudget_.load(std::memory_order_relaxed);
+    return st;
+}
+
+EventBase& EventBase::setTimerWheel(int slotBits, int levels) {
+    fatalif(imp_->timers_->size(), "timer wheel can only be changed before adding timers");
+    imp_->timers_.reset(new TimerWheel(slotBits, levels));
+    return *this;
+}
+
 bool EventBase::cancel(TimerId timerid) { return imp_ && imp_->cancel(timerid); }
 
 TimerId EventBase::runAt(int64_t milli, Task&& task, int64_t interval) {
     return imp_->runAt(milli, std::move(task), interval);
 }
 
-EventsImp::EventsImp(EventBase* base, int taskCap): //不设置超时,idle disabled
-    base_(base), poller_(createPoller()), exit_(false), nextTimeout_(1<<30), tasks_(taskCap),
-    timerSeq_(0), idleEnabled(false)
+EventsImp::EventsImp(EventBase* base, int taskCap, int spinUs): //不设置超时,idle disabled
+    base_(base), poller_(createPoller()), exit_(false), nextTimeout_(1<<30), tasks_(taskCap), wakeupPending_(false),
+    timers_(new TimerWheel()), idleEnabled(false), edgeTrigger_(false), busyPollUs_(0), cpu_(-1),
+    spinMax_(spinUs), spinBudget_(spinUs), spinUs_(0), blockUs_(0), spinHits_(0), blocks_(0),
+    conns_(0), pendingConns_(0), maxConns_(0), lagUs_(0)
 {
+    poller_->metrics_ = &metrics_;
 }
 
 void EventsImp::loop() {
-    while (!exit_)
-        loop_once(10000);  //10000ns or ms
-    timerReps_.clear(); //清除所有
-    timers_.clear();
+    if (cpu_ >= 0) {
+        int r = port::setAffinity(cpu_);
+        if (r) {
+            warn("bind loop thread to cpu %d failed %d %s", cpu_, errno, strerror(errno));
+        } else {
+            info("loop thread bound to cpu %d node %d", cpu_, port::cpuNode(cpu_));
+        }
+    }
+    while (!exit_) {
+        if (spinMax_ == 0) {
+            loop_once(10000);  //10000ns or ms
+        } else if (!spin()) { //自旋期间没有事件，转为阻塞等待
+            int64_t spun = spinBudget_.load(std::memory_order_relaxed);
+            loop_once(10000);
+            adaptSpin(spun + poller_->lastWaitUs_);
+        }
+    }
+    timers_->clear(); //清除所有
     idleConns_.clear();
     for (auto recon: reconnectConns_) { //重连的连接无法通过channel清理，因此单独清理
         recon->cleanup(recon);
@@ -121,45 +220,111 @@ void EventsImp::loop() {
 }
 
 void EventsImp::init() {
+#ifdef OS_LINUX
+    wakeupFds_[0] = wakeupFds_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fatalif(wakeupFds_[0] < 0, "eventfd failed %d %s", errno, strerror(errno));
+    trace("wakeup eventfd created %d", wakeupFds_[0]);
+#else
     int r = pipe(wakeupFds_);  //搞一个管道
     fatalif(r, "pipe failed %d %s", errno, strerror(errno));
     r = util::addFdFlag(wakeupFds_[0], FD_CLOEXEC); //使用execl执行的程序里，此描述符被关闭，不能再使用它
     fatalif(r, "addFdFlag failed %d %s", errno, strerror(errno));
     r = util::addFdFlag(wakeupFds_[1], FD_CLOEXEC); //使用execl执行的程序里，此描述符被关闭，不能再使用它
     fatalif(r, "addFdFlag failed %d %s", errno, strerror(errno));
+    r = net::setNonBlock(wakeupFds_[1]); //管道写满时不阻塞
+    fatalif(r, "setNonBlock failed %d %s", errno, strerror(errno));
     trace("wakeup pipe created %d %d", wakeupFds_[0], wakeupFds_[1]);
+#endif
     Channel* ch = new Channel(base_, wakeupFds_[0], kReadEvent); //读事件,对于事件管理器管道的读入口，也就是事件管理器有可读时
     ch->onRead([=] {  //注册一个频道的读回调函数
         char buf[1024];
         int r = ch->fd() >= 0 ? ::read(ch->fd(), buf, sizeof buf) : 0;
         if (r > 0) {  //读到了东西
+            wakeupPending_.exchange(false, std::memory_order_acq_rel); //先清除标记再取任务，之后加入的任务会再次唤醒
+            metrics_.taskDepth.add(tasks_.size());
             Task task;
-            while (tasks_.pop_wait(&task, 0)) { //事件管理器的任务函数里pop一个内容到task
+            int n = 0;
+            while (n < kTaskBatch && tasks_.pop(&task)) { //事件管理器的任务函数里pop一个内容到task
                 task(); //执行
+                n ++;
+            }
+            if (n == kTaskBatch && tasks_.size()) { //还有剩余任务，先处理本轮的io，下一轮继续
+                wakeupPending_.store(true, std::memory_order_release);
+                wakeup();
             }
         } else if (r == 0) {  //没读到
             delete ch;    //删掉频道
-        } else if (errno == EINTR) {
+        } else if (errno == EINTR || errno == EAGAIN) {
         } else {
             fatal("wakeup channel read error %d %d %s", r, errno, strerror(errno));
         }
     });
 }
 
+bool EventsImp::spin() {
+    int64_t start = util::timeMicro();
+    int64_t deadline = start + spinBudget_.load(std::memory_order_relaxed);
+    for (;;) {
+        int64_t now = util::timeMicro();
+        poller_->loop_once(0);
+        if (poller_->lastReady_) {
+            spinUs_.store(spinUs_.load(std::memory_order_relaxed) + now - start + poller_->lastWaitUs_, std::memory_order_relaxed);
+            spinHits_.store(spinHits_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            handleTimeouts();
+            runEndTasks();
+            record(now, false);
+            return true;
+        }
+        handleTimeouts();
+        runEndTasks();
+        now = util::timeMicro();
+        if (exit_ || now >= deadline) {
+            spinUs_.store(spinUs_.load(std::memory_order_relaxed) + now - start, std::memory_order_relaxed);
+            return exit_;
+        }
+    }
+}
+
+//与kvm的halt polling类似：空闲时长在上限内说明再多转一会儿就能等到，预算加倍；超过上限则自旋是浪费，预算减半
+void EventsImp::adaptSpin(int64_t idleUs) {
+    int budget = spinBudget_.load(std::memory_order_relaxed);
+    if (idleUs <= spinMax_) {
+        budget = std::min(spinMax_, std::max(budget * 2, std::max(spinMax_ / 8, 1)));
+    } else {
+        budget /= 2;
+    }
+    spinBudget_.store(budget, std::memory_order_relaxed);
+}
+
+void EventsImp::record(int64_t start, bool blocked) {
+    int64_t waited = poller_->lastWaitUs_;
+    if (blocked) {
+        blockUs_.store(blockUs_.load(std::memory_order_relaxed) + waited, std::memory_order_relaxed);
+        blocks_.store(blocks_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        metrics_.waitUs.add(waited);
+    }
+    if (blocked || poller_->lastReady_) {
+        metrics_.events.add(poller_->lastReady_);
+        int64_t busy = util::timeMicro() - start - waited;
+        metrics_.busyUs.add(busy);
+        int64_t lag = lagUs_.load(std::memory_order_relaxed);
+        lagUs_.store(lag + (busy - lag) / 8, std::memory_order_relaxed);
+    }
+}
+
 void EventsImp::handleTimeouts() { //如何处理定时任务
     int64_t now = util::timeMilli();
-    TimerId tid { now, 1L<<62 }; //现在到永远
-    while (timers_.size() && timers_.begin()->first < tid) { //在now之前需要执行的
-        Task task = move(timers_.begin()->second);  //把定时器需要执行的函数拿出来
-        timers_.erase(timers_.begin()); //清除任务
-        task(); //执行
+    if (timers_->nearest() <= now) { //按格批量执行到期的任务
+        timers_->expire(now, &metrics_.timerLagMs);
     }
     refreshNearest();
 }
 
 EventsImp::~EventsImp() {
-    delete poller_; //干掉poller
-    ::close(wakeupFds_[1]); //这种是外部的close函数，也就是系统的close
+    delete poller_; //干掉poller，wakeupFds_[0]随通道一起关闭
+    if (wakeupFds_[1] != wakeupFds_[0]) {
+        ::close(wakeupFds_[1]); //这种是外部的close函数，也就是系统的close
+    }
 }
 
 void EventsImp::callIdles() { //idleNode关联函数
@@ -203,61 +368,95 @@ void EventsImp::updateIdle(const IdleId& id) { //更新一个IdleId的时间，
     id->lst_->splice(id->lst_->end(), *id->lst_, id->iter_);
 }
 
-void EventsImp::refreshNearest(const TimerId* tid){ //tid没用上
-    if (timers_.empty()) {
-        nextTimeout_ = 1 << 30;   //定时器数组是空的，就永远不超时
+void EventsImp::refreshNearest() {
+    int64_t nearest = timers_->nearest();
+    if (nearest == numeric_limits<int64_t>::max()) {
+        nextTimeout_ = 1 << 30;   //没有定时器，就永远不超时
     } else {
-        const TimerId &t = timers_.begin()->first;
-        nextTimeout_ = t.first - util::timeMilli();
-        nextTimeout_ = nextTimeout_ < 0 ? 0 : nextTimeout_;
+        int64_t wait = nearest - util::timeMilli();
+        nextTimeout_ = wait < 0 ? 0 : wait > (1 << 30) ? 1 << 30 : (int)wait;
     }
 }
 
-void EventsImp::repeatableTimeout(TimerRepeatable* tr) {
-    tr->at += tr->interval;  //设置下一次超时
-    tr->timerid = { tr->at, ++timerSeq_ };  //定时器id由下次超时时间和时间序列构成
-    timers_[tr->timerid] = [this, tr] { repeatableTimeout(tr); }; //定时器id对应的再设置函数
-    refreshNearest(&tr->timerid); //把这个已经执行的挪到最后去
-    tr->cb(); //执行定时器回调函数
-}
-
 TimerId EventsImp::runAt(int64_t milli, Task&& task, int64_t interval) {
     if (exit_) {
         return TimerId();
     }
-    if (interval) { //有执行间隔
-        TimerId tid { -milli, ++timerSeq_};
-        TimerRepeatable& rtr = timerReps_[tid]; //重复任务的数组
-        rtr = { milli, interval, { milli, ++timerSeq_ }, move(task) }; //设置TimerRepeatable和任务
-        TimerRepeatable* tr = &rtr;
-        timers_[tr->timerid] = [this, tr] { repeatableTimeout(tr); }; //添加任务函数到std::map<TimerId, Task>
-        refreshNearest(&tr->timerid);
-        return tid;
-    } else { //一次执行非间隔
-        TimerId tid { milli, ++timerSeq_}; //当前和timerSeq_
-        timers_.insert({tid, move(task)}); //直接加进去就行了
-        refreshNearest(&tid);
-        return tid;
-    }
+    TimerId tid = timers_->add(milli, move(task), interval);
+    refreshNearest();
+    return tid;
 }
 
 bool EventsImp::cancel(TimerId timerid) {
-    if (timerid.first < 0) {  //间隔任务
-        auto p = timerReps_.find(timerid); //TimeReps数组里找到TimerId
-        auto ptimer = timers_.find(p->second.timerid); //timerid和任务处理函数
-        if (ptimer != timers_.end()) { //找到了
-            timers_.erase(ptimer);   //删掉这个定时器
+    return timers_->cancel(timerid);
+}
+
+MultiBase::MultiBase(int sz, Policy policy):
+    id_(0), bases_(sz), policy_(policy), busySums_(sz), recentBusy_(sz), busySampled_(0)
+{
+    const int kVirtualNodes = 64;
+    for (int i = 0; i < sz; i ++) {
+        for (int j = 0; j < kVirtualNodes; j ++) {
+            ring_.push_back({util::hash32(i * kVirtualNodes + j), i});
         }
-        timerReps_.erase(p); //删掉这个任务
-        return true;
-    } else { //非间隔任务
-        auto p = timers_.find(timerid);
-        if (p != timers_.end()) {
-            timers_.erase(p); //删掉
-            return true;
+    }
+    sort(ring_.begin(), ring_.end());
+}
+
+EventBase* MultiBase::allocBase(const Ip4Addr& peer) {
+    EventBase* b = &bases_[pick(&peer)];
+    b->reserveConn();
+    return b;
+}
+
+int MultiBase::pick(const Ip4Addr* peer) {
+    int sz = bases_.size();
+    if (alloccb_) {
+        int i = alloccb_(this, peer);
+        fatalif(i < 0 || i >= sz, "alloc callback returned %d, bases %d", i, sz);
+        return i;
+    }
+    if (policy_ == LeastConns) {
+        int best = 0;
+        for (int i = 1; i < sz; i ++) {
+            if (bases_[i].connCount() < bases_[best].connCount()) {
+                best = i;
+            }
         }
-        return false;
+        return best;
+    } else if (policy_ == LeastBusy) {
+        std::lock_guard<std::mutex> lk(busyMutex_);
+        int64_t now = util::timeMilli();
+        if (now - busySampled_ >= 100) { //每100毫秒采样一次各循环的处理时间
+            for (int i = 0; i < sz; i ++) {
+                int64_t sum = bases_[i].loopMetrics().busyUs.sum();
+                recentBusy_[i] = sum - busySums_[i];
+                busySums_[i] = sum;
+            }
+            busySampled_ = now;
+        }
+        int best = 0;
+        for (int i = 1; i < sz; i ++) {
+            if (recentBusy_[i] < recentBusy_[best]
+                || (recentBusy_[i] == recentBusy_[best] && bases_[i].connCount() < bases_[best].connCount())) {
+                best = i;
+            }
+        }
+        recentBusy_[best] += recentBusy_[best] / 16 + 1; //同一周期内连续分配时避免全部落到同一个循环
+        return best;
+    } else if (policy_ == PeerHash && peer) {
+        auto p = lower_bound(ring_.begin(), ring_.end(), make_pair(util::hash32(peer->ipInt()), 0));
+        return p == ring_.end() ? ring_.front().second : p->second;
     }
+    return (id_++ & 0x7fffffff) % sz;
+}
+
+MultiBase& MultiBase::setAffinity(const vector<int>& cpus) {
+    int ncpu = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t i = 0; i < bases_.size(); i ++) {
+        bases_[i].setCpu(cpus.empty() ? i % ncpu : cpus[i % cpus.size()]);
+    }
+    return *this;
 }
 
 void MultiBase::loop() {
@@ -273,8 +472,8 @@ void MultiBase::loop() {
     }
 }
 
-Channel::Channel(EventBase* base, int fd, int events): base_(base), fd_(fd), events_(events) {
-    fatalif(net::setNonBlock(fd_) < 0, "channel set non block failed");
+Channel::Channel(EventBase* base, int fd, int events, bool edge, bool nonBlocked): base_(base), fd_(fd), events_(events), edge_(edge) {
+    fatalif(!nonBlocked && net::setNonBlock(fd_) < 0, "channel set non block failed");
     static atomic<int64_t> id(0);
     id_ = ++id;
     poller_ = base_->imp_->poller_;
@@ -338,15 +537,26 @@ void handyUpdateIdle(EventBase* base, const IdleId& idle) {
     base->imp_->updateIdle(idle);
 }
 
+void handyConnAttached(EventBase* base) {
+    EventsImp* imp = base->imp_.get();
+    imp->conns_ ++;
+    int pending = imp->pendingConns_;
+    while (pending > 0 && !imp->pendingConns_.compare_exchange_weak(pending, pending - 1)) {
+    }
+}
+
+void handyConnClosed(EventBase* base) {
+    base->imp_->conns_ --;
+}
+
 TcpConn::TcpConn()
-:base_(NULL), channel_(NULL), state_(State::Invalid), destPort_(-1),
- connectTimeout_(0), reconnectInterval_(-1),connectedTime_(util::timeMilli())
+:base_(NULL), channel_(NULL), state_(State::Invalid)
 {
 }
 
 TcpConn::~TcpConn() {
     trace("tcp destroyed %s - %s", local_.toString().c_str(), peer_.toString().c_str());
-    delete channel_;
+    closeChannel();
 }
 
 void TcpConn::addIdleCB(int idle, const TcpCallBack& cb) {
@@ -358,15 +568,17 @@ void TcpConn::addIdleCB(int idle, const TcpCallBack& cb) {
 void TcpConn::reconnect() {
     auto con = shared_from_this();
     getBase()->imp_->reconnectConns_.insert(con);
-    long long interval = reconnectInterval_-(util::timeMilli()-connectedTime_);
+    TcpClientInfo& ci = *client_;
+    long long interval = ci.reconnectInterval-(util::timeMilli()-ci.connectedTime);
     interval = interval>0?interval:0;
-    info("reconnect interval: %d will reconnect after %lld ms", reconnectInterval_, interval);
+    info("reconnect interval: %d will reconnect after %lld ms", ci.reconnectInterval, interval);
     getBase()->runAfter(interval, [this, con]() {
         getBase()->imp_->reconnectConns_.erase(con);
-        connect(getBase(), destHost_, (short)destPort_, connectTimeout_, localIp_);
+        TcpClientInfo& ci = *client_;
+        connect(getBase(), ci.destHost, (short)ci.destPort, ci.connectTimeout, ci.localIp);
     });
-    delete channel_;
-    channel_ = NULL;
+    closeChannel();
+    self_.reset(); //由reconnectConns_持有，重连时attach再设置
 }
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "handy-imp.h"
 #include "poller.h"
+#include "metrics.h"
 
 namespace handy {
 
@@ -11,12 +12,28 @@ typedef std::function<void(const TcpConnPtr&, Slice msg)> MsgCallBack;  //tcp连
 
 struct EventBases: private noncopyable {  //不可copy
     virtual EventBase* allocBase() = 0; //allocBase必须重载
+    //为对端地址为peer的新连接分配事件派发器
+    virtual EventBase* allocBase(const Ip4Addr&) { return allocBase(); }
+    //包含的事件派发器个数及第i个，用于每个派发器各自监听
+    virtual int size() { return 1; }
+    virtual EventBase* getBase(int i) = 0;
+};
+
+//事件循环的运行统计，时间单位为微秒
+struct LoopStat {
+    int64_t spinUs;         //自旋等待（零超时轮询）的时间
+    int64_t blockUs;        //阻塞在epoll_wait等调用中的时间
+    int64_t spinHits;       //自旋期间等到事件的次数
+    int64_t blocks;         //阻塞等待的次数
+    int64_t spinBudgetUs;   //当前的自旋预算
 };
 
 //事件派发器，可管理定时器，连接，超时连接
 struct EventBase: public EventBases { //从不可cp函数继承
     //taskCapacity指定任务队列的大小，0无限制
-    EventBase(int taskCapacity=0);
+    //spinUs非0时开启自旋模式：阻塞之前先用零超时轮询最多spinUs微秒，
+    //实际自旋预算根据空闲时长自动调整，空闲短于spinUs时加倍，长于spinUs时减半
+    EventBase(int taskCapacity=0, int spinUs=0);
     ~EventBase();
     //处理已到期的事件,waitMs表示若无当前需要处理的任务，需要等待的时间
     void loop_once(int waitMs);
@@ -30,6 +47,8 @@ struct EventBase: public EventBases { //从不可cp函数继承
     TimerId runAt(int64_t milli, Task&& task, int64_t interval=0);
     TimerId runAfter(int64_t milli, const Task& task, int64_t interval=0) { return runAt(util::timeMilli()+milli, Task(task), interval); }
     TimerId runAfter(int64_t milli, Task&& task, int64_t interval=0) { return runAt(util::timeMilli()+milli, std::move(task), interval);}
+    //本轮io事件与到期的定时任务处理完后执行一次task，用于合并本轮产生的输出，只能在事件循环线程调用
+    void atLoopEnd(Task&& task);
 
     //下列函数为线程安全的
 
@@ -44,6 +63,35 @@ struct EventBase: public EventBases { //从不可cp函数继承
     void safeCall(const Task& task) { safeCall(Task(task)); }
     //分配一个事件派发器
     virtual EventBase* allocBase() { return this; }
+    virtual EventBase* allocBase(const Ip4Addr&) { reserveConn(); return this; }
+    virtual EventBase* getBase(int) { return this; }
+    //定时器时间轮每层2^slotBits格，共levels层，格子为1毫秒，需在添加定时器之前设置
+    EventBase& setTimerWheel(int slotBits, int levels);
+    //新建的TcpConn是否使用边缘触发，需在创建连接之前设置
+    EventBase& setEdgeTrigger(bool edge);
+    bool edgeTrigger();
+    //新建的TcpConn设置SO_BUSY_POLL，单位微秒，0不设置
+    EventBase& setBusyPoll(int usec);
+    int busyPoll();
+    //事件循环的运行统计，可在任意线程调用
+    LoopStat loopStat();
+    //事件循环的直方图指标，可在任意线程读取
+    const LoopMetrics& loopMetrics();
+    //事件循环线程绑定的cpu，-1不绑定，在loop开始时生效
+    //绑定后此线程分配的内存（连接缓冲区等）按首次访问落在该cpu所在的NUMA结点上
+    EventBase& setCpu(int cpu);
+    int cpu();
+    //当前的连接数，包含已分配到此EventBase但尚未attach的连接
+    int connCount();
+    //分配器选中此EventBase时调用，之后连接attach时抵消
+    void reserveConn();
+    //选中后未attach就放弃时调用，抵消reserveConn
+    void releaseConn();
+    //接受连接时此EventBase的连接数上限，0不限制，由TcpServer检查
+    EventBase& setMaxConns(int maxConns);
+    int maxConns();
+    //事件循环的延迟：每轮循环处理时间的指数平滑值（1/8），单位微秒，可在任意线程调用
+    int64_t loopLagUs();
 
 public:
     std::unique_ptr<EventsImp> imp_;  //EventBase的唯一成员
@@ -51,27 +99,53 @@ public:
 
 //多线程的事件派发器
 struct MultiBase: public EventBases{
-    MultiBase(int sz): id_(0), bases_(sz) {}
-    virtual EventBase* allocBase() { int c = id_++; return &bases_[c%bases_.size()]; }
+    //新连接的分配策略
+    enum Policy {
+        RoundRobin,     //轮流分配
+        LeastConns,     //连接数最少
+        LeastBusy,      //最近100毫秒处理时间最少，相同时取连接数少的，allocBase()不带peer时同样适用
+        PeerHash,       //按对端ip一致性哈希，同一客户端总是落在同一个EventBase，不带peer时轮流分配
+    };
+    //自定义分配，peer为NULL表示不是为连接分配，返回bases中的下标
+    typedef std::function<int(MultiBase* bases, const Ip4Addr* peer)> AllocCallBack;
+    MultiBase(int sz, Policy policy=RoundRobin);
+    virtual EventBase* allocBase() { return &bases_[pick(NULL)]; }
+    virtual EventBase* allocBase(const Ip4Addr& peer);
+    MultiBase& setPolicy(Policy policy) { policy_ = policy; return *this; }
+    MultiBase& onAlloc(const AllocCallBack& cb) { alloccb_ = cb; return *this; }
+    virtual int size() { return bases_.size(); }
+    virtual EventBase* getBase(int i) { return &bases_[i]; }
+    //第i个EventBase的线程绑定到cpus[i % cpus.size()]，cpus为空时绑定到第i个cpu，需在loop之前调用
+    MultiBase& setAffinity(const std::vector<int>& cpus=std::vector<int>());
     //循环从bases_返回一个又一个EventBase
     void loop();
     MultiBase& exit() { for (auto& b: bases_) { b.exit(); } return *this; }  //退出
 private:
     std::atomic<int> id_; //加个id
     std::vector<EventBase> bases_;  //数组
+    Policy policy_;
+    AllocCallBack alloccb_;
+    std::mutex busyMutex_;
+    std::vector<int64_t> busySums_, recentBusy_; //各EventBase的累计处理时间和最近一个周期的处理时间
+    int64_t busySampled_;
+    std::vector<std::pair<uint32_t, int>> ring_; //一致性哈希环，每个EventBase有多个虚拟结点
+    int pick(const Ip4Addr* peer);
 };
 
 //通道包括事件管理器,poller和events组成
 //通道，封装了可以进行epoll的一个fd
 struct Channel: private noncopyable {
     //!!base为事件管理器，fd为通道内部的fd，events为通道关心的事件!!，通道就是读写buffer和规则的集合
-    Channel(EventBase* base, int fd, int events); //Channel关联事件管理器，文件描述符，和事件
+    //edge为true时使用边缘触发，读写回调需要处理到EAGAIN为止
+    //nonBlocked为true表示fd已是非阻塞的（如accept4返回的），不再设置
+    Channel(EventBase* base, int fd, int events, bool edge=false, bool nonBlocked=false); //Channel关联事件管理器，文件描述符，和事件
     ~Channel();
     EventBase* getBase() { return base_; }
     int fd() { return fd_; }
     //通道id
     int64_t id() { return id_; }
     short events() { return events_; }
+    bool edgeTriggered() { return edge_; }
     //关闭通道
     void close();
 
@@ -80,6 +154,9 @@ struct Channel: private noncopyable {
     void onWrite(const Task& writecb) { writecb_ = writecb; }
     void onRead(Task&& readcb) { readcb_ = std::move(readcb); }
     void onWrite(Task&& writecb) { writecb_ = std::move(writecb); }
+    //出错或挂断时回调，之后poller仍会按就绪事件调用读写回调
+    void onError(const Task& errorcb) { errorcb_ = errorcb; }
+    void onError(Task&& errorcb) { errorcb_ = std::move(errorcb); }
 
     //启用读写监听
     void enableRead(bool enable);
@@ -91,11 +168,13 @@ struct Channel: private noncopyable {
     //处理读写事件
     void handleRead() { readcb_(); }
     void handleWrite() { writecb_(); }
+    void handleError() { if (errorcb_) errorcb_(); }
 protected:
     EventBase* base_;
     PollerBase* poller_;
     int fd_;
     short events_;
+    bool edge_;
     int64_t id_;
     std::function<void()> readcb_, writecb_, errorcb_;  //通道的各种callbacks 函数
 };
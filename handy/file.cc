@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 using namespace std;
 
 namespace handy {
@@ -106,4 +107,80 @@ bool file::fileExists(const std::string& fname) {   //存在
     return access(fname.c_str(), F_OK) == 0;
 }
 
+OpenFile::~OpenFile() {
+    close(fd);
+}
+
+static Status openFile(const string& path, OpenFilePtr* file) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Status::ioError("open", path);
+    }
+    OpenFilePtr f(new OpenFile(fd));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return Status::ioError("fstat", path);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EISDIR;
+        return Status::ioError("open", path);
+    }
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->checked = util::timeMilli();
+    *file = f;
+    return Status();
+}
+
+Status FileCache::open(const string& path, OpenFilePtr* file) {
+    int64_t now = util::timeMilli();
+    OpenFilePtr cached;
+    {
+        lock_guard<mutex> lk(mutex_);
+        auto p = files_.find(path);
+        if (p != files_.end()) {
+            if (now - p->second->checked < checkMs_) {
+                *file = p->second;
+                return Status();
+            }
+            cached = p->second;
+        }
+    }
+    struct stat st;
+    if (cached && stat(path.c_str(), &st) == 0 && (uint64_t)st.st_dev == cached->dev && (uint64_t)st.st_ino == cached->ino
+        && st.st_size == cached->size && st.st_mtime == cached->mtime) {
+        lock_guard<mutex> lk(mutex_);
+        cached->checked = now; //未变化，继续使用已打开的fd
+        *file = cached;
+        return Status();
+    }
+    Status s = openFile(path, file);
+    lock_guard<mutex> lk(mutex_);
+    if (!s.ok()) {
+        files_.erase(path);
+        return s;
+    }
+    if (files_.size() >= capacity_ && !files_.count(path)) { //满时先淘汰没有被使用的文件
+        for (auto p = files_.begin(); p != files_.end() && files_.size() >= capacity_; ) {
+            if (p->second.use_count() == 1) {
+                p = files_.erase(p);
+            } else {
+                ++p;
+            }
+        }
+        if (files_.size() >= capacity_) {
+            files_.erase(files_.begin());
+        }
+    }
+    files_[path] = *file;
+    return s;
+}
+
+FileCache& FileCache::instance() {
+    static FileCache cache;
+    return cache;
+}
+
 }
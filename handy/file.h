@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <map>
+#include <memory>
+#include <mutex>
 #include "status.h"
 
 namespace handy {
@@ -18,4 +21,31 @@ struct file {
     static bool fileExists(const std::string& fname);
 };
 
+//只读打开的文件，最后一个引用释放时关闭
+struct OpenFile: private noncopyable {
+    int fd;
+    int64_t size;
+    int64_t mtime;
+    uint64_t dev, ino;
+    int64_t checked;    //上次stat检查的毫秒时间
+    OpenFile(int f): fd(f), size(0), mtime(0), dev(0), ino(0), checked(0) {}
+    ~OpenFile();
+};
+typedef std::shared_ptr<OpenFile> OpenFilePtr;
+
+//按路径缓存打开的文件及其大小，checkMs毫秒内重复打开同一路径不再调用open/fstat
+//超过checkMs后重新stat，文件被修改或替换时重新打开，线程安全
+struct FileCache: private noncopyable {
+    FileCache(int checkMs=1000, size_t capacity=1024): checkMs_(checkMs), capacity_(capacity) {}
+    Status open(const std::string& path, OpenFilePtr* file);
+    size_t size() { std::lock_guard<std::mutex> lk(mutex_); return files_.size(); }
+    //进程共享的缓存，HttpConnPtr::sendFile使用
+    static FileCache& instance();
+private:
+    int checkMs_;
+    size_t capacity_;
+    std::mutex mutex_;
+    std::map<std::string, OpenFilePtr> files_;
+};
+
 }
@@ -21,16 +21,16 @@ typedef std::pair<int64_t, int64_t> TimerId;  //一个时间对
 
 struct AutoContext: noncopyable {
     void* ctx;
-    Task ctxDel;
-    AutoContext():ctx(0) {}
+    void (*ctxDel)(void*); //用函数指针而不是std::function，每个连接省下32字节
+    AutoContext():ctx(0), ctxDel(0) {}
     template<class T> T& context() {
         if (ctx == NULL) {
             ctx = new T();
-            ctxDel = [this] { delete (T*)ctx; };
+            ctxDel = [](void* p) { delete (T*)p; };
         }
         return *(T*)ctx;
     }
-    ~AutoContext() { if (ctx) ctxDel(); }
+    ~AutoContext() { if (ctx) ctxDel(ctx); }
 };
 
 }
@@ -3,6 +3,7 @@
 #include "file.h"
 #include "http.h"
 #include "logging.h"
+#include "metrics.h"
 #include "slice.h"
 #include "threads.h"
 #include "util.h"
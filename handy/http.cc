@@ -2,6 +2,8 @@
 #include "file.h"
 #include "status.h"
 #include "logging.h"
+#include <algorithm>
+#include <unistd.h>
 
 using namespace std;
 
@@ -78,7 +80,7 @@ HttpMsg::Result HttpMsg::tryDecode_(Slice buf, bool copyBody, Slice* line1) {
     return complete_ ? Complete : NotComplete;
 }
 
-int HttpRequest::encode(Buffer& buf) {
+int HttpRequest::encodeHead(Buffer& buf, size_t contentLen) {
     size_t osz = buf.size();
     char conlen[1024], reqln[4096];
     snprintf(reqln, sizeof reqln, "%s %s %s\n\n", method.c_str(), query_uri.c_str(), version.c_str());
@@ -87,9 +89,9 @@ int HttpRequest::encode(Buffer& buf) {
         buf.append(hd.first).append(": ").append(hd.second).append("\r\n");
     }
     buf.append("Connection: Keep-Alive\r\n");
-    snprintf(conlen, sizeof conlen, "Content-Length: %lu\r\n", getBody().size());
+    snprintf(conlen, sizeof conlen, "Content-Length: %lu\r\n", (unsigned long)contentLen);
     buf.append(conlen);
-    buf.append("\r\n").append(getBody());
+    buf.append("\r\n");
     return buf.size() - osz;
 }
 
@@ -134,7 +136,7 @@ HttpMsg::Result HttpRequest::tryDecode(Slice buf, bool copyBody) {
     return r;
 }
 
-int HttpResponse::encode(Buffer& buf) {
+int HttpResponse::encodeHead(Buffer& buf, size_t contentLen) {
     size_t osz = buf.size();
     char conlen[1024], statusln[1024];
     snprintf(statusln, sizeof statusln, 
@@ -144,9 +146,9 @@ int HttpResponse::encode(Buffer& buf) {
         buf.append(hd.first).append(": ").append(hd.second).append("\r\n");
     }
     buf.append("Connection: Keep-Alive\r\n");
-    snprintf(conlen, sizeof conlen, "Content-Length: %lu\r\n", getBody().size());
+    snprintf(conlen, sizeof conlen, "Content-Length: %lu\r\n", (unsigned long)contentLen);
     buf.append(conlen);
-    buf.append("\r\n").append(getBody());
+    buf.append("\r\n");
     return buf.size() - osz;
 }
 
@@ -161,18 +163,117 @@ HttpMsg::Result HttpResponse::tryDecode(Slice buf, bool copyBody) {
     return r;
 }
 
+void HttpConnPtr::sendMsg(HttpMsg& msg, const char* title) const {
+    Slice body = msg.getBody();
+    if (body.size() < kRefBody || msg.body2.size()) { //小的body与头部一起复制，body2由调用者持有，无法确定生命周期，也复制
+        msg.encode(tcp->getOutput());
+        logOutput(title);
+        clearData();
+        tcp->sendOutput();
+        return;
+    }
+    //大的body移出消息，与头部一起writev，不复制
+    msg.encodeHead(tcp->getOutput(), body.size());
+    logOutput(title);
+    clearData();
+    std::shared_ptr<string> b(new string);
+    b->swap(msg.body);
+    tcp->sendRef(b->data(), b->size(), [b] {});
+}
+
+//解析非负整数，必须全是数字
+static bool parseOffset(const string& s, int64_t* v) {
+    if (s.empty() || s.size() > 18) {
+        return false;
+    }
+    *v = 0;
+    for (char c: s) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        *v = *v * 10 + (c - '0');
+    }
+    return true;
+}
+
+//解析单个区间的Range头部，得到[begin, end)
+//返回1表示可以满足，0表示区间超出文件无法满足，-1表示格式错误或不支持，此时忽略Range头部
+static int parseRange(Slice range, int64_t size, int64_t* begin, int64_t* end) {
+    if (!range.starts_with("bytes=")) {
+        return -1;
+    }
+    range.eat(6);
+    range.trimSpace();
+    const char* p = range.begin();
+    const char* e = range.end();
+    const char* dash = std::find(p, e, '-');
+    if (dash == e || std::find(dash + 1, e, ',') != e) { //多个区间需要multipart，不支持
+        return -1;
+    }
+    string first(p, dash), last(dash + 1, e);
+    int64_t b = 0, l = 0;
+    if (first.empty()) { //bytes=-n，最后n个字节
+        if (!parseOffset(last, &l)) {
+            return -1;
+        }
+        *begin = std::max((int64_t)0, size - l);
+        *end = size;
+    } else {
+        if (!parseOffset(first, &b) || (last.size() && (!parseOffset(last, &l) || l < b))) {
+            return -1;
+        }
+        *begin = b;
+        *end = last.empty() ? size : std::min(size, l + 1);
+    }
+    return *begin < *end ? 1 : 0;
+}
+
 void HttpConnPtr::sendFile(const string& filename) const {
-    string cont;
-    Status st = file::getContent(filename, cont);
     HttpResponse& resp = getResponse();
+    OpenFilePtr f;
+    Status st = FileCache::instance().open(filename, &f);
     if (st.code() == ENOENT) {
         resp.setNotFound();
+        return sendResponse();
     } else if (st.code()) {
         resp.setStatus(500, st.msg());
-    } else {
-        resp.body2 = cont;
+        return sendResponse();
+    }
+    int64_t begin = 0, end = f->size;
+    string range = tcp->isClient() ? "" : getRequest().getHeader("range");
+    resp.headers["Accept-Ranges"] = "bytes";
+    int r = range.size() ? parseRange(range, f->size, &begin, &end) : -1;
+    if (r >= 0) {
+        if (r == 0) {
+            resp.setStatus(416, "Range Not Satisfiable");
+            resp.headers["Content-Range"] = util::format("bytes */%lld", (long long)f->size);
+            sendResponse();
+            resp.clear();
+            return;
+        }
+        resp.setStatus(206, "Partial Content");
+        resp.body.clear();
+        resp.headers["Content-Range"] = util::format("bytes %lld-%lld/%lld", (long long)begin, (long long)end - 1, (long long)f->size);
+    }
+    size_t len = end - begin;
+    Buffer& out = tcp->getOutput();
+    resp.encodeHead(out, len);
+    logOutput("http resp");
+    clearData();
+    resp.clear(); //头部已编码，不让Content-Range等留到下一个响应
+    if (len >= kRefBody) {
+        tcp->sendFile(f->fd, begin, len, [f] {});
+        return;
+    }
+    //小文件直接读入，与头部一起发送
+    ssize_t rd = pread(f->fd, out.makeRoom(len), len, begin);
+    if (rd != (ssize_t)len) {
+        error("read %s failed %ld %d %s", filename.c_str(), (long)rd, errno, strerror(errno));
+        tcp->close();
+        return;
     }
-    sendResponse();
+    out.addSize(len);
+    tcp->sendOutput();
 }
 
 void HttpConnPtr::onHttpMsg(const HttpCallBack& cb) const {
@@ -12,7 +12,9 @@ struct HttpMsg {
     HttpMsg() { HttpMsg::clear(); };
 
     //内容添加到buf，返回写入的字节数
-    virtual int encode(Buffer& buf)=0;
+    int encode(Buffer& buf) { int n = encodeHead(buf, getBody().size()); buf.append(getBody()); return n + getBody().size(); }
+    //只把起始行与头部添加到buf，Content-Length为contentLen，返回写入的字节数
+    virtual int encodeHead(Buffer& buf, size_t contentLen)=0;
     //尝试从buf中解析，默认复制body内容
     virtual Result tryDecode(Slice buf, bool copyBody=true)=0;
     //清空消息相关的字段
@@ -43,7 +45,7 @@ struct HttpRequest: public HttpMsg {
     std::string getArg(const std::string& n) { return map_get(args, n); }
 
     //override
-    virtual int encode(Buffer& buf);
+    virtual int encodeHead(Buffer& buf, size_t contentLen);
     virtual Result tryDecode(Slice buf, bool copyBody=true);
     virtual void clear() { HttpMsg::clear(); args.clear(); method = "GET"; query_uri = uri = ""; }
 };
@@ -56,7 +58,7 @@ struct HttpResponse: public HttpMsg {
     void setStatus(int st, const std::string& msg="") { status = st; statusWord = msg; body = msg; }
 
     //override
-    virtual int encode(Buffer& buf);
+    virtual int encodeHead(Buffer& buf, size_t contentLen);
     virtual Result tryDecode(Slice buf, bool copyBody=true);
     virtual void clear() { HttpMsg::clear(); status = 200; statusWord = "OK"; }
 };
@@ -76,9 +78,11 @@ struct HttpConnPtr {
 
     void sendRequest() const { sendRequest(getRequest()); }
     void sendResponse() const { sendResponse(getResponse()); }
-    void sendRequest(HttpRequest& req) const { req.encode(tcp->getOutput()); logOutput("http req"); clearData(); tcp->sendOutput(); }
-    void sendResponse(HttpResponse& resp) const { resp.encode(tcp->getOutput()); logOutput("http resp"); clearData(); tcp->sendOutput(); }
-    //文件作为Response
+    //body不小于kRefBody时从消息中移出，与头部一起writev发送而不复制，发送后消息的body为空
+    void sendRequest(HttpRequest& req) const { sendMsg(req, "http req"); }
+    void sendResponse(HttpResponse& resp) const { sendMsg(resp, "http resp"); }
+    //文件作为Response，支持单个区间的Range请求
+    //文件经FileCache打开，小文件读入输出缓冲区与头部一起发送，大文件用TcpConn::sendFile流式发送
     void sendFile(const std::string& filename) const;
     void clearData() const;
 
@@ -88,8 +92,10 @@ protected:
         HttpRequest req;
         HttpResponse resp;
     };
+    static const size_t kRefBody = 16 * 1024;
     void handleRead(const HttpCallBack& cb) const;
     void logOutput(const char* title) const;
+    void sendMsg(HttpMsg& msg, const char* title) const;
 };
 
 typedef HttpConnPtr::HttpCallBack HttpCallBack;
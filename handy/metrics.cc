@@ -0,0 +1,92 @@
+#include "metrics.h"
+
+using namespace std;
+
+namespace handy {
+
+Histogram::Histogram(): count_(0), sum_(0), max_(0) {
+    for (auto& b: buckets_) {
+        b.store(0, memory_order_relaxed);
+    }
+}
+
+//小于8的值各占一个桶，其余按最高位所在的区间和其后3位分桶
+int Histogram::bucketOf(int64_t v) {
+    if (v < (1 << kSubBits)) {
+        return v < 0 ? 0 : (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int m = (v >> (e - kSubBits)) & ((1 << kSubBits) - 1);
+    return ((e - kSubBits + 1) << kSubBits) + m;
+}
+
+int64_t Histogram::upperOf(int idx) {
+    if (idx < (1 << kSubBits)) {
+        return idx;
+    }
+    int e = (idx >> kSubBits) + kSubBits - 1;
+    int64_t m = idx & ((1 << kSubBits) - 1);
+    int shift = e - kSubBits;
+    return (((1LL << kSubBits) + m) << shift) + (1LL << shift) - 1;
+}
+
+void Histogram::add(int64_t v) {
+    //只有一个写入者，用load+store代替带锁前缀的原子加
+    auto inc = [](atomic<int64_t>& a, int64_t d) { a.store(a.load(memory_order_relaxed) + d, memory_order_relaxed); };
+    inc(buckets_[bucketOf(v)], 1);
+    inc(count_, 1);
+    inc(sum_, v);
+    if (v > max_.load(memory_order_relaxed)) {
+        max_.store(v, memory_order_relaxed);
+    }
+}
+
+int64_t Histogram::percentile(double p) const {
+    int64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    int64_t need = (int64_t)(total * p);
+    need = need < 1 ? 1 : need;
+    int64_t seen = 0;
+    for (int i = 0; i < kBuckets; i ++) {
+        seen += buckets_[i].load(memory_order_relaxed);
+        if (seen >= need) {
+            return std::min(upperOf(i), max());
+        }
+    }
+    return max();
+}
+
+string Histogram::toString() const {
+    int64_t n = count();
+    return util::format("count %lld avg %lld p50 %lld p90 %lld p99 %lld p999 %lld max %lld",
+                        (long long)n, (long long)(n ? sum() / n : 0),
+                        (long long)percentile(0.5), (long long)percentile(0.9), (long long)percentile(0.99),
+                        (long long)percentile(0.999), (long long)max());
+}
+
+string LoopMetrics::summary() const {
+    return util::format("wakeups %lld events p99 %lld wait p99 %lld us busy p99 %lld us handler p99 %lld us "
+                        "slowest %lld us channel %lld timer lag p99 %lld ms task depth p99 %lld",
+                        (long long)events.count(), (long long)events.percentile(0.99),
+                        (long long)waitUs.percentile(0.99), (long long)busyUs.percentile(0.99),
+                        (long long)handlerUs.percentile(0.99), (long long)slowestUs.load(memory_order_relaxed),
+                        (long long)slowestChannel.load(memory_order_relaxed), (long long)timerLagMs.percentile(0.99),
+                        (long long)taskDepth.percentile(0.99));
+}
+
+string LoopMetrics::toString() const {
+    string r;
+    r += "events: " + events.toString() + "\n";
+    r += "wait us: " + waitUs.toString() + "\n";
+    r += "busy us: " + busyUs.toString() + "\n";
+    r += "handler us: " + handlerUs.toString() + "\n";
+    r += util::format("slowest handler: %lld us channel %lld\n",
+                      (long long)slowestUs.load(memory_order_relaxed), (long long)slowestChannel.load(memory_order_relaxed));
+    r += "timer lag ms: " + timerLagMs.toString() + "\n";
+    r += "task depth: " + taskDepth.toString() + "\n";
+    return r;
+}
+
+}
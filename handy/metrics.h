@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include "util.h"
+
+namespace handy {
+
+//对数分桶的直方图，每个2的幂区间再分为8个桶，相对误差不超过1/8
+//只允许一个线程写入，任意线程都可以无锁读取
+struct Histogram: private noncopyable {
+    Histogram();
+    void add(int64_t v);
+    int64_t count() const { return count_.load(std::memory_order_relaxed); }
+    int64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    int64_t max() const { return max_.load(std::memory_order_relaxed); }
+    //返回不小于p(0-1)比例样本的桶的上界
+    int64_t percentile(double p) const;
+    //count avg p50 p90 p99 p999 max
+    std::string toString() const;
+private:
+    static const int kSubBits = 3;
+    static const int kBuckets = (64 - kSubBits) << kSubBits;
+    static int bucketOf(int64_t v);
+    static int64_t upperOf(int idx);
+    std::atomic<int64_t> buckets_[kBuckets];
+    std::atomic<int64_t> count_, sum_, max_;
+};
+
+//一个事件循环的运行指标，由事件循环线程写入
+struct LoopMetrics: private noncopyable {
+    Histogram events;       //每次唤醒取到的事件数
+    Histogram waitUs;       //在epoll_wait等调用中等待的时间
+    Histogram busyUs;       //每轮循环中除等待外的时间，即处理事件和定时器的时间
+    Histogram handlerUs;    //单个通道一次回调的耗时
+    Histogram timerLagMs;   //定时任务实际执行与到期时间的差
+    Histogram taskDepth;    //处理safeCall任务时队列中的任务数
+    std::atomic<int64_t> slowestUs;      //最慢的一次通道回调
+    std::atomic<int64_t> slowestChannel; //最慢回调所属的通道id
+
+    LoopMetrics(): slowestUs(0), slowestChannel(0) {}
+    void handled(int64_t channel, int64_t us) {
+        handlerUs.add(us);
+        if (us > slowestUs.load(std::memory_order_relaxed)) {
+            slowestUs.store(us, std::memory_order_relaxed);
+            slowestChannel.store(channel, std::memory_order_relaxed);
+        }
+    }
+    //一行摘要
+    std::string summary() const;
+    //每个直方图一行
+    std::string toString() const;
+};
+
+}
@@ -2,10 +2,15 @@
 #include "util.h"
 #include "logging.h"
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
+#ifdef OS_LINUX
+#include <linux/filter.h>
+#endif
 #include <string>
+#include <atomic>
 
 using namespace std;
 namespace handy {
@@ -38,6 +43,69 @@ int net::setReusePort(int fd, bool value) { //端口重用
 #endif
 }
 
+int net::setBusyPoll(int fd, int usec) {
+#ifndef SO_BUSY_POLL
+    errno = ENOPROTOOPT;
+    return -1;
+#else
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec);
+#endif
+}
+
+int net::setIncomingCpu(int fd, int cpu) {
+#ifndef SO_INCOMING_CPU
+    errno = ENOPROTOOPT;
+    return -1;
+#else
+    return setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu);
+#endif
+}
+
+int net::setZeroCopy(int fd) {
+#ifndef SO_ZEROCOPY
+    errno = ENOPROTOOPT;
+    return -1;
+#else
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one);
+#endif
+}
+
+int net::setReusePortCpuSteer(int fd, int groupSize) {
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+    errno = ENOPROTOOPT;
+    return -1;
+#else
+    //A = 当前cpu; A = A % groupSize; return A
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)groupSize },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof code / sizeof code[0], code };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+#endif
+}
+
+int net::setUdpSegment(int fd, int segSize) {
+#ifndef UDP_SEGMENT
+    errno = ENOPROTOOPT;
+    return -1;
+#else
+    return setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segSize, sizeof segSize);
+#endif
+}
+
+int net::setUdpGro(int fd, bool value) {
+#ifndef UDP_GRO
+    errno = ENOPROTOOPT;
+    return -1;
+#else
+    int flag = value;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &flag, sizeof flag);
+#endif
+}
+
 int net::setNoDelay(int fd, bool value) { //这个选项的作用就是启用或禁用 Nagle’s Algorithm
     int flag = value;
     int len = sizeof flag;
@@ -92,6 +160,111 @@ bool Ip4Addr::isIpValid() const { //s_addr不是INADRR_NONE
     return addr_.sin_addr.s_addr != INADDR_NONE;
 }
 
+namespace {
+
+const int kMinPoolBits = 6, kMaxPoolBits = 20;
+const int kPoolClasses = kMaxPoolBits - kMinPoolBits + 1;
+std::atomic<size_t> g_poolRetain(256 * 1024);
+
+//每个线程的空闲链表，块的头部存放下一块的指针
+struct PoolCache {
+    char* heads[kPoolClasses];
+    size_t counts[kPoolClasses];
+    BufferPool::Stat stat;
+    PoolCache(): stat() {
+        memset(heads, 0, sizeof heads);
+        memset(counts, 0, sizeof counts);
+    }
+    ~PoolCache();
+    void trim();
+};
+
+//线程退出时，析构晚于PoolCache的对象仍可能释放Buffer，此后直接delete
+thread_local bool t_poolDead = false;
+thread_local PoolCache t_pool;
+
+void PoolCache::trim() {
+    for (int i = 0; i < kPoolClasses; i ++) {
+        while (heads[i]) {
+            char* p = heads[i];
+            heads[i] = *(char**)p;
+            delete[] p;
+            stat.frees ++;
+        }
+        stat.cached -= counts[i] << (i + kMinPoolBits);
+        counts[i] = 0;
+    }
+}
+
+PoolCache::~PoolCache() {
+    trim();
+    t_poolDead = true;
+}
+
+int poolClass(size_t cap) {
+    if (cap <= ((size_t)1 << kMinPoolBits)) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(cap - 1) - kMinPoolBits;
+}
+
+}
+
+char* BufferPool::alloc(size_t* cap) {
+    int c = poolClass(*cap);
+    if (c >= kPoolClasses || t_poolDead) {
+        if (!t_poolDead) {
+            t_pool.stat.allocs ++;
+        }
+        return new char[*cap];
+    }
+    *cap = (size_t)1 << (c + kMinPoolBits);
+    PoolCache& pc = t_pool;
+    if (pc.heads[c]) {
+        char* p = pc.heads[c];
+        pc.heads[c] = *(char**)p;
+        pc.counts[c] --;
+        pc.stat.cached -= *cap;
+        pc.stat.hits ++;
+        return p;
+    }
+    pc.stat.allocs ++;
+    return new char[*cap];
+}
+
+void BufferPool::free(char* p, size_t cap) {
+    int c = poolClass(cap);
+    if (t_poolDead) {
+        delete[] p;
+        return;
+    }
+    PoolCache& pc = t_pool;
+    if (c >= kPoolClasses || pc.counts[c] * cap >= g_poolRetain.load(std::memory_order_relaxed)) { //至少保留一块，retain为0时不保留
+        pc.stat.frees ++;
+        delete[] p;
+        return;
+    }
+    *(char**)p = pc.heads[c];
+    pc.heads[c] = p;
+    pc.counts[c] ++;
+    pc.stat.cached += cap;
+    pc.stat.returns ++;
+}
+
+void BufferPool::setRetain(size_t bytes) {
+    g_poolRetain.store(bytes, std::memory_order_relaxed);
+}
+
+BufferPool::Stat BufferPool::stat() {
+    return t_poolDead ? Stat() : t_pool.stat;
+}
+
+void BufferPool::trim() {
+    if (!t_poolDead) {
+        t_pool.trim();
+    }
+}
+
 char* Buffer::makeRoom(size_t len) {
     if (e_ + len <= cap_) {   //最可能的，后边可以放下
     } else if (size() + len < cap_ / 2) {
@@ -104,11 +277,13 @@ char* Buffer::makeRoom(size_t len) {
 
 void Buffer::expand(size_t len) {
     size_t ncap = std::max(exp_, std::max(2*cap_, size()+len));
-    char* p = new char[ncap];
+    char* p = BufferPool::alloc(&ncap);
     std::copy(begin(), end(), p);
     e_ -= b_;
     b_ = 0;
-    delete[] buf_;
+    if (buf_) {
+        BufferPool::free(buf_, cap_);
+    }
     buf_ = p;
     cap_ = ncap;
 }
@@ -116,7 +291,7 @@ void Buffer::expand(size_t len) {
 void Buffer::copyFrom(const Buffer& b) { //把b的数据给新建
     memcpy(this, &b, sizeof b);
     if (b.buf_) {
-        buf_ = new char[cap_];  //buf_是新的
+        buf_ = BufferPool::alloc(&cap_);  //buf_是新的
         memcpy(data(), b.begin(), b.size()); //更新buf_
     }
 }
@@ -15,6 +15,19 @@ struct net {
     static int setReuseAddr(int fd, bool value=true);
     static int setReusePort(int fd, bool value=true);
     static int setNoDelay(int fd, bool value=true);
+    //SO_BUSY_POLL，阻塞读时在驱动中忙等usec微秒，超过net.core.busy_poll需要CAP_NET_ADMIN，平台不支持时返回-1，errno为ENOPROTOOPT
+    static int setBusyPoll(int fd, int usec);
+    //SO_INCOMING_CPU，reuseport的监听socket设置后，内核优先把在该cpu上收到的连接交给它，不支持的系统返回-1
+    static int setIncomingCpu(int fd, int cpu);
+    //SO_ZEROCOPY，之后带MSG_ZEROCOPY的sendmsg不再复制数据，完成通知从错误队列中读取，不支持的系统返回-1
+    static int setZeroCopy(int fd);
+    //给fd所在的reuseport组挂上cBPF程序，收到连接的cpu对groupSize取模，选中组内按加入顺序的第几个socket
+    //需在组内所有socket listen之后调用，不支持的系统返回-1
+    static int setReusePortCpuSteer(int fd, int groupSize);
+    //UDP_SEGMENT，之后长于segSize的报文由内核按segSize切成多个报文发送，0关闭，不支持的系统返回-1
+    static int setUdpSegment(int fd, int segSize);
+    //UDP_GRO，内核把同一对端的连续报文合并后一次交给应用，不支持的系统返回-1
+    static int setUdpGro(int fd, bool value);
 };
 
 struct Ip4Addr { //IpAddr相关操作
@@ -33,10 +46,33 @@ private:
     struct sockaddr_in addr_;
 };
 
+//Buffer的内存池，按2的幂从64字节到1M分级，每个线程各自的空闲链表，不加锁
+//内存在一个线程分配、另一个线程释放时进入释放线程的链表；超过1M的块直接new/delete
+struct BufferPool {
+    struct Stat {
+        int64_t hits;     //从空闲链表取得的次数
+        int64_t allocs;   //向系统new的次数
+        int64_t returns;  //放回空闲链表的次数
+        int64_t frees;    //向系统delete的次数，包括超过保留上限的块
+        size_t cached;    //空闲链表中的字节数
+    };
+    //分配不小于*cap字节的内存，*cap改为实际大小
+    static char* alloc(size_t* cap);
+    //cap为alloc返回的大小
+    static void free(char* p, size_t cap);
+    //每个线程每一级最多保留的空闲字节数，0为不保留，默认256K，所有线程生效
+    static void setRetain(size_t bytes);
+    //当前线程的统计
+    static Stat stat();
+    //释放当前线程的所有空闲块
+    static void trim();
+};
+
 struct Buffer {
     Buffer(): buf_(NULL), b_(0), e_(0), cap_(0), exp_(512) {}
-    ~Buffer() { delete[] buf_; }
-    void clear() { delete[] buf_; buf_ = NULL; cap_ = 0; b_ = e_ = 0; }
+    ~Buffer() { if (buf_) BufferPool::free(buf_, cap_); }
+    //内存还给当前线程的内存池，稳定收发消息时清空后再次使用不会向系统分配
+    void clear() { if (buf_) BufferPool::free(buf_, cap_); buf_ = NULL; cap_ = 0; b_ = e_ = 0; }
     size_t size() const { return e_ - b_; }
     bool empty() const  { return e_ == b_; }
     char* data() const  { return buf_ + b_; } //buf从b开始是数据
@@ -55,7 +91,8 @@ struct Buffer {
     Buffer& absorb(Buffer& buf);
     void setSuggestSize(size_t sz) { exp_ = sz; } // exp_ 是期望的size
     Buffer(const Buffer& b) { copyFrom(b); } //（）就是从b弄过来
-    Buffer& operator=(const Buffer& b) { delete[] buf_; buf_ = NULL; copyFrom(b); return *this; } //=就是从b弄过来
+    Buffer(Buffer&& b): buf_(b.buf_), b_(b.b_), e_(b.e_), cap_(b.cap_), exp_(b.exp_) { b.buf_ = NULL; b.b_ = b.e_ = b.cap_ = 0; } //取走b的内存
+    Buffer& operator=(const Buffer& b) { if (&b != this) { clear(); copyFrom(b); } return *this; } //=就是从b弄过来
     operator Slice () { return Slice(data(), size()); } //Slice(buffer) =等价于从buffer做一个Slice
 private:
     char* buf_;
@@ -4,6 +4,8 @@
 #include <fcntl.h>
 #include "poller.h"
 #include "conn.h"
+#include "metrics.h"
+#include <vector>
 
 #ifdef OS_LINUX     //这些是跨平台的编译时写法
 #include <sys/epoll.h>
@@ -16,11 +18,67 @@
 
 namespace handy {
 
+//按fd索引的通道表，增删都是O(1)
+//key由fd和代数组成，通道删除或重新注册时代数递增，已取出的旧事件因代数不符而被忽略
+struct ChannelTable {
+    struct Slot {
+        Channel* ch;
+        uint32_t gen;
+        int live;   //在lives_中的下标
+    };
+    std::vector<Slot> slots_;
+    std::vector<int> lives_; //存活通道的fd，用于退出时遍历
+
+    static int fdOf(uint64_t key) { return (int)(uint32_t)key; }
+    uint64_t keyOf(int fd) { return (uint64_t)slots_[fd].gen << 32 | (uint32_t)fd; }
+    uint64_t add(Channel* ch) {
+        int fd = ch->fd();
+        if ((size_t)fd >= slots_.size()) {
+            slots_.resize(std::max((size_t)fd + 1, slots_.size() * 2), Slot{ NULL, 0, -1 });
+        }
+        Slot& slot = slots_[fd];
+        fatalif(slot.ch, "fd %d already has channel %lld", fd, (long long)slot.ch->id());
+        slot.ch = ch;
+        slot.gen ++;
+        slot.live = lives_.size();
+        lives_.push_back(fd);
+        return keyOf(fd);
+    }
+    //重新生成key，之前取出的事件失效
+    uint64_t renew(int fd) { slots_[fd].gen ++; return keyOf(fd); }
+    bool remove(Channel* ch) {
+        int fd = ch->fd();
+        if (fd < 0 || (size_t)fd >= slots_.size() || slots_[fd].ch != ch) {
+            return false;
+        }
+        Slot& slot = slots_[fd];
+        int back = lives_.back();
+        lives_[slot.live] = back;
+        slots_[back].live = slot.live;
+        lives_.pop_back();
+        slot.ch = NULL;
+        slot.gen ++;
+        slot.live = -1;
+        return true;
+    }
+    //key对应的通道仍存活且未重新注册时返回通道，否则返回NULL
+    Channel* get(uint64_t key) {
+        int fd = fdOf(key);
+        if ((size_t)fd >= slots_.size()) {
+            return NULL;
+        }
+        Slot& slot = slots_[fd];
+        return slot.gen == (uint32_t)(key >> 32) ? slot.ch : NULL;
+    }
+    size_t size() { return lives_.size(); }
+    Channel* back() { return slots_[lives_.back()].ch; }
+};
+
 #ifdef OS_LINUX
 
 struct PollerEpoll : public PollerBase{
     int fd_; //一个fd
-    std::set<Channel*> liveChannels_;   //一个channels的set
+    ChannelTable channels_;   //按fd索引的通道表
     //for epoll selected active events
     struct epoll_event activeEvs_[kMaxEvents];  //active 事件数组
     PollerEpoll();
@@ -31,7 +89,11 @@ struct PollerEpoll : public PollerBase{
     void loop_once(int waitMs) override;
 };
 
-PollerBase* createPoller() { return new PollerEpoll(); } //新建
+
+//边缘触发的通道加上EPOLLET，此后只在状态变化时通知
+static uint32_t epollEvents(Channel* ch) {
+    return ch->events() | (ch->edgeTriggered() ? (int)EPOLLET : 0);
+}
 
 PollerEpoll::PollerEpoll(){
     fd_ = epoll_create1(EPOLL_CLOEXEC);  //拿到一个epoll的描述符，execl时关闭
@@ -41,8 +103,8 @@ PollerEpoll::PollerEpoll(){
 
 PollerEpoll::~PollerEpoll() {
     info("destroying poller %d", fd_);
-    while (liveChannels_.size()) {
-        (*liveChannels_.begin())->close();
+    while (channels_.size()) {
+        channels_.back()->close();
     }
     ::close(fd_);
     info("poller %d destroyed", fd_);
@@ -51,19 +113,18 @@ PollerEpoll::~PollerEpoll() {
 void PollerEpoll::addChannel(Channel* ch) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev)); //置0
-    ev.events = ch->events(); //设定epoll的event
-    ev.data.ptr = ch; //设定epoll的data
-    trace("adding channel %lld fd %d events %d epoll %d", (long long)ch->id(), ch->fd(), ev.events, fd_);
+    ev.events = epollEvents(ch); //设定epoll的event
+    ev.data.u64 = channels_.add(ch); //设定epoll的data
+    trace("adding channel %lld fd %d events %d edge %d epoll %d", (long long)ch->id(), ch->fd(), ev.events, ch->edgeTriggered(), fd_);
     int r = epoll_ctl(fd_, EPOLL_CTL_ADD, ch->fd(), &ev);//绑定注册到内核
     fatalif(r, "epoll_ctl add failed %d %s", errno, strerror(errno));
-    liveChannels_.insert(ch); //加到LiveChannels里去
 }
 
 void PollerEpoll::updateChannel(Channel* ch) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
-    ev.events = ch->events();
-    ev.data.ptr = ch;
+    ev.events = epollEvents(ch);
+    ev.data.u64 = channels_.keyOf(ch->fd());
     trace("modifying channel %lld fd %d events read %d write %d epoll %d",
           (long long)ch->id(), ch->fd(), ev.events & POLLIN, ev.events & POLLOUT, fd_);
     int r = epoll_ctl(fd_, EPOLL_CTL_MOD, ch->fd(), &ev); //改监控数据
@@ -72,46 +133,57 @@ void PollerEpoll::updateChannel(Channel* ch) {
 
 void PollerEpoll::removeChannel(Channel* ch) {
     trace("deleting channel %lld fd %d epoll %d", (long long)ch->id(), ch->fd(), fd_);
-    liveChannels_.erase(ch);
-    for (int i = lastActive_; i >= 0; i --) {
-        if (ch == activeEvs_[i].data.ptr) {    //从activeEvs_里找到频道数据置空
-            activeEvs_[i].data.ptr = NULL;
-            break;
-        }
-    }
+    channels_.remove(ch); //已取出的事件在处理时通过代数识别
 }
 
 void PollerEpoll::loop_once(int waitMs) { //这个是EventBase的loop里调用的
-    int64_t ticks = util::timeMilli();
+    int64_t ticks = util::timeMicro();
     lastActive_ = epoll_wait(fd_, activeEvs_, kMaxEvents, waitMs); //等待最新准备好的数目
-    int64_t used = util::timeMilli()-ticks;  //耗时多少ms
-    trace("epoll wait %d return %d errno %d used %lld millsecond",
-          waitMs, lastActive_, errno, (long long)used);
+    lastWaitUs_ = util::timeMicro()-ticks;  //耗时多少us
+    trace("epoll wait %d return %d errno %d used %lld microsecond",
+          waitMs, lastActive_, errno, (long long)lastWaitUs_);
     fatalif(lastActive_ == -1 && errno != EINTR, "epoll return error %d %s", errno, strerror(errno));
+    lastReady_ = lastActive_ > 0 ? lastActive_ : 0;
+    int64_t last = metrics_ && lastReady_ ? util::timeMicro() : 0;
     //没等到就报fatal
     while (--lastActive_ >= 0) { //一个个处理
         int i = lastActive_;
-        Channel* ch = (Channel*)activeEvs_[i].data.ptr; //复制数据
+        uint64_t key = activeEvs_[i].data.u64;
+        Channel* ch = channels_.get(key); //已删除的通道返回NULL
+        if (!ch) {
+            continue;
+        }
+        int64_t id = ch->id(); //回调中通道可能被删除，先记下id
         int events = activeEvs_[i].events; //复制事件
-        if (ch) {
-            if (events & (kReadEvent | POLLERR)) {   //读事件
-                trace("channel %lld fd %d handle read", (long long)ch->id(), ch->fd());
-                ch->handleRead();
-            } else if (events & kWriteEvent) {   //写事件
-                trace("channel %lld fd %d handle write", (long long)ch->id(), ch->fd());
-                ch->handleWrite();
-            } else {
-                fatal("unexpected poller events");
-            }
+        //同一轮里依次处理错误、读、写；每个回调都可能关闭通道，之后key失效
+        if (ch && (events & (POLLERR | POLLHUP))) {
+            trace("channel %lld fd %d handle error events %d", (long long)ch->id(), ch->fd(), events);
+            ch->handleError();
+        }
+        if (ch && channels_.get(key) && (events & (kReadEvent | POLLERR | POLLHUP))) {   //读事件
+            trace("channel %lld fd %d handle read", (long long)ch->id(), ch->fd());
+            ch->handleRead();
+        }
+        if (ch && channels_.get(key) && (events & kWriteEvent) && ch->writeEnabled()) {   //写事件，读回调中可能已关闭写
+            trace("channel %lld fd %d handle write", (long long)ch->id(), ch->fd());
+            ch->handleWrite();
+        }
+        if (metrics_) {
+            int64_t now = util::timeMicro();
+            metrics_->handled(id, now - last);
+            last = now;
         }
     }
 }
+
+PollerBase* createPoller() { return new PollerEpoll(); }
+
 //mac的就不读了
 #elif defined(OS_MACOSX)
 
 struct PollerKqueue : public PollerBase {
     int fd_;
-    std::set<Channel*> liveChannels_;
+    ChannelTable channels_;
     //for epoll selected active events
     struct kevent activeEvs_[kMaxEvents];
     PollerKqueue();
@@ -132,8 +204,8 @@ PollerKqueue::PollerKqueue(){
 
 PollerKqueue::~PollerKqueue() {
     info("destroying poller %d", fd_);
-    while (liveChannels_.size()) {
-        (*liveChannels_.begin())->close();
+    while (channels_.size()) {
+        channels_.back()->close();
     }
     ::close(fd_);
     info("poller %d destroyed", fd_);
@@ -145,17 +217,18 @@ void PollerKqueue::addChannel(Channel* ch) {
     now.tv_sec = 0;
     struct kevent ev[2];
     int n = 0;
+    int clear = ch->edgeTriggered() ? EV_CLEAR : 0;
+    void* key = (void*)(uintptr_t)channels_.add(ch);
     if (ch->readEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD|EV_ENABLE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD|EV_ENABLE|clear, 0, 0, key);
     }
     if (ch->writeEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD|EV_ENABLE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD|EV_ENABLE|clear, 0, 0, key);
     }
     trace("adding channel %lld fd %d events read %d write %d  epoll %d",
           (long long)ch->id(), ch->fd(), ch->events() & POLLIN, ch->events() & POLLOUT, fd_);
     int r = kevent(fd_, ev, n, NULL, 0, &now);
     fatalif(r, "kevent add failed %d %s", errno, strerror(errno));
-    liveChannels_.insert(ch);
 }
 
 void PollerKqueue::updateChannel(Channel* ch) {
@@ -164,15 +237,17 @@ void PollerKqueue::updateChannel(Channel* ch) {
     now.tv_sec = 0;
     struct kevent ev[2];
     int n = 0;
+    int clear = ch->edgeTriggered() ? EV_CLEAR : 0;
+    void* key = (void*)(uintptr_t)channels_.keyOf(ch->fd());
     if (ch->readEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD|EV_ENABLE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD|EV_ENABLE|clear, 0, 0, key);
     } else {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_DELETE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_DELETE, 0, 0, key);
     }
     if (ch->writeEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD|EV_ENABLE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD|EV_ENABLE|clear, 0, 0, key);
     } else {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_DELETE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_DELETE, 0, 0, key);
     }
     trace("modifying channel %lld fd %d events read %d write %d epoll %d",
           (long long)ch->id(), ch->fd(), ch->events() & POLLIN, ch->events() & POLLOUT, fd_);
@@ -182,40 +257,46 @@ void PollerKqueue::updateChannel(Channel* ch) {
 
 void PollerKqueue::removeChannel(Channel* ch) {
     trace("deleting channel %lld fd %d epoll %d", (long long)ch->id(), ch->fd(), fd_);
-    liveChannels_.erase(ch);
-    // remove channel if in ready stat
-    for (int i = lastActive_; i >= 0; i --) {
-        if (ch == activeEvs_[i].udata) {
-            activeEvs_[i].udata = NULL;
-            break;
-        }
-    }
+    channels_.remove(ch); //已取出的事件在处理时通过代数识别
 }
 
 void PollerKqueue::loop_once(int waitMs) {
     struct timespec timeout;
     timeout.tv_sec = waitMs / 1000;
     timeout.tv_nsec = (waitMs % 1000) * 1000 * 1000;
-    long ticks = util::timeMilli();
+    int64_t ticks = util::timeMicro();
     lastActive_ = kevent(fd_, NULL, 0, activeEvs_, kMaxEvents, &timeout);
-    trace("kevent wait %d return %d errno %d used %lld millsecond",
-          waitMs, lastActive_, errno, util::timeMilli()-ticks);
+    lastWaitUs_ = util::timeMicro()-ticks;
+    trace("kevent wait %d return %d errno %d used %lld microsecond",
+          waitMs, lastActive_, errno, (long long)lastWaitUs_);
     fatalif(lastActive_ == -1 && errno != EINTR, "kevent return error %d %s", errno, strerror(errno));
+    lastReady_ = lastActive_ > 0 ? lastActive_ : 0;
+    int64_t last = metrics_ && lastReady_ ? util::timeMicro() : 0;
     while (--lastActive_ >= 0) {
         int i = lastActive_;
-        Channel* ch = (Channel*)activeEvs_[i].udata;
         struct kevent& ke = activeEvs_[i];
-        if (ch) {
-            // only handle write if read and write are enabled
-            if (!(ke.flags & EV_EOF) && ch->writeEnabled()) {
-                trace("channel %lld fd %d handle write", (long long)ch->id(), ch->fd());
-                ch->handleWrite();
-            } else if ((ke.flags & EV_EOF) || ch->readEnabled()) {
-                trace("channel %lld fd %d handle read", (long long)ch->id(), ch->fd());
-                ch->handleRead();
-            } else {
-                fatal("unexpected epoll events %d", ch->events());
-            }
+        uint64_t key = (uintptr_t)ke.udata;
+        Channel* ch = channels_.get(key);
+        if (!ch) {
+            continue;
+        }
+        int64_t id = ch->id();
+        //kqueue中读写是不同的filter，分别作为独立事件返回；出错时先回调错误处理
+        if (ch && ((ke.flags & EV_ERROR) || ((ke.flags & EV_EOF) && ke.fflags))) {
+            trace("channel %lld fd %d handle error flags %d", (long long)ch->id(), ch->fd(), (int)ke.flags);
+            ch->handleError();
+        }
+        if (ch && channels_.get(key) && (ke.filter == EVFILT_READ || (ke.flags & EV_EOF))) {
+            trace("channel %lld fd %d handle read", (long long)ch->id(), ch->fd());
+            ch->handleRead();
+        } else if (ch && channels_.get(key) && ke.filter == EVFILT_WRITE) {
+            trace("channel %lld fd %d handle write", (long long)ch->id(), ch->fd());
+            ch->handleWrite();
+        }
+        if (metrics_) {
+            int64_t now = util::timeMicro();
+            metrics_->handled(id, now - last);
+            last = now;
         }
     }
 }
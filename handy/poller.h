@@ -11,6 +11,8 @@
 
 namespace handy {
 
+struct LoopMetrics;
+
 const int kMaxEvents = 2000;   //最大事件
 const int kReadEvent = POLLIN;  //有数据可读
 const int kWriteEvent = POLLOUT; //写数据不会导致阻塞
@@ -18,7 +20,10 @@ const int kWriteEvent = POLLOUT; //写数据不会导致阻塞
 struct PollerBase: private noncopyable {
     int64_t id_;
     int lastActive_;
-    PollerBase(): lastActive_(-1) { static std::atomic<int64_t> id(0); id_ = ++id; }
+    int lastReady_;         //上一次loop_once取到的事件数
+    int64_t lastWaitUs_;    //上一次loop_once在内核中等待的微秒数，不含回调时间
+    LoopMetrics* metrics_;  //非空时记录每个通道回调的耗时
+    PollerBase(): lastActive_(-1), lastReady_(0), lastWaitUs_(0), metrics_(NULL) { static std::atomic<int64_t> id(0); id_ = ++id; }
     virtual void addChannel(Channel* ch) = 0;
     virtual void removeChannel(Channel* ch) = 0;
     virtual void updateChannel(Channel* ch) = 0;
@@ -4,6 +4,11 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sched.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 namespace handy {
 namespace port{
@@ -26,6 +31,34 @@ namespace port{
         return addr;
     }
     uint64_t gettid() { return syscall(SYS_gettid); }  //OS_LINUX的调用
+    int setAffinity(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int r = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+        if (r) {
+            errno = r;
+            return -1;
+        }
+        return 0;
+    }
+    int cpuNode(int cpu) { //sysfs中cpu目录下有指向所属结点的nodeN
+        char path[64];
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+        DIR* dir = opendir(path);
+        int node = 0;
+        if (dir) {
+            struct dirent* ent;
+            while ((ent = readdir(dir)) != NULL) {
+                if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+                    node = atoi(ent->d_name + 4);
+                    break;
+                }
+            }
+            closedir(dir);
+        }
+        return node;
+    }
 #elif defined(OS_MACOSX)
     struct in_addr getHostByName(const std::string& host) {
         struct in_addr addr;
@@ -43,6 +76,8 @@ namespace port{
         memcpy(&uid, &tid, std::min(sizeof(tid), sizeof(uid)));
         return uid;
     }
+    int setAffinity(int cpu) { errno = ENOTSUP; return -1; } //macos只支持亲和性提示，不支持绑定
+    int cpuNode(int cpu) { return 0; }
 #endif
 
 }
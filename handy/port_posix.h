@@ -31,5 +31,9 @@ namespace handy {
         inline int64_t htobe(int64_t v) { return (int64_t)htobe((uint64_t)v); }
         struct in_addr getHostByName(const std::string& host);
         uint64_t gettid();
+        //把当前线程绑定到cpu上，成功返回0，不支持的系统返回-1
+        int setAffinity(int cpu);
+        //cpu所在的NUMA结点，无法获取时返回0
+        int cpuNode(int cpu);
     }
 }
@@ -70,6 +70,17 @@ StatServer::StatServer(EventBase* base): server_(base) {
     });
 }
 
+void StatServer::onLoop(const string& name, EventBase* base) {
+    onState(name, "event loop metrics", [base] { return base->loopMetrics().summary(); });
+    onPage(name + "-detail", "event loop histograms", [base] {
+        LoopStat st = base->loopStat();
+        string r = util::format("spin %lld us hits %lld block %lld us blocks %lld spin budget %lld us\n",
+                                (long long)st.spinUs, (long long)st.spinHits, (long long)st.blockUs,
+                                (long long)st.blocks, (long long)st.spinBudgetUs);
+        return r + base->loopMetrics().toString();
+    });
+}
+
 void StatServer::onRequest(StatType type, const string& key, const string& desc, const StatCallBack& cb){
     if (type == STATE) {
         statcbs_[key] = { desc, cb };
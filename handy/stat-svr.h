@@ -28,6 +28,8 @@ struct StatServer: private noncopyable {
     //用于发送一个命令
     void onCmd(const string& cmd, const string& desc, const InfoCallBack& cb) { onRequest(CMD, cmd, desc, cb); }
     void onCmd(const string& cmd, const string& desc, const IntCallBack& cb) { onRequest(CMD, cmd, desc, [cb] { return util::format("%ld", cb()); }); }
+    //展示一个事件循环的运行指标，name为摘要，name-detail为完整的直方图
+    void onLoop(const string& name, EventBase* base);
 private:
     HttpServer server_;
     typedef std::pair<std::string, StatCallBack> DescState;
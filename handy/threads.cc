@@ -1,11 +1,16 @@
 #include "threads.h"
 #include <assert.h>
 #include <utility>
+#include <string.h>
+#include <errno.h>
+#include "port_posix.h"
+#include "logging.h"
 using namespace std;
 
 namespace handy {
 
 template class SafeQueue<Task>;
+template class MpscQueue<Task>;
 
 ThreadPool::ThreadPool(int threads, int maxWaiting, bool start):
 tasks_(maxWaiting), threads_(threads) //设置capacity,初始化线程数组的初始数目
@@ -24,9 +29,13 @@ ThreadPool::~ThreadPool() {
 }
 
 void ThreadPool::start() { //定义了一个pool，然后启动他
-    for (auto& th: threads_) {
+    for (size_t i = 0; i < threads_.size(); i ++) {
+        int cpu = cpus_.empty() ? -1 : cpus_[i % cpus_.size()];
         thread t(
-            [this] {
+            [this, cpu] {
+                if (cpu >= 0 && port::setAffinity(cpu)) {
+                    warn("bind pool thread to cpu %d failed %d %s", cpu, errno, strerror(errno));
+                }
                 while (!tasks_.exited()) { //当this->exit_不为真时
                     Task task; //定义个函数
                     if (tasks_.pop_wait(&task)) {  //合适的时机把task函数设为从队列头函数
@@ -35,7 +44,7 @@ void ThreadPool::start() { //定义了一个pool，然后启动他
                 }
             }
         );
-        th.swap(t);
+        threads_[i].swap(t);
     }
 }
 
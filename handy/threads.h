@@ -36,14 +36,41 @@ private:
     void wait_ready(std::unique_lock<std::mutex>& lk, int waitMs);  //加锁等xxms
 };
 
+//无锁的多生产者单消费者队列，push可在任意线程调用，pop只能在同一个消费者线程调用
+//生产者之间只有一次原子交换，不加锁
+template<typename T> struct MpscQueue: private noncopyable {
+    //0 不限制队列中的任务数
+    MpscQueue(size_t capacity=0);
+    ~MpscQueue();
+    //队列满则返回false
+    bool push(T&& v);
+    //队列空返回false
+    bool pop(T* v);
+    size_t size() { return size_.load(std::memory_order_relaxed); }
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        T v;
+        Node(): next(NULL) {}
+        Node(T&& t): next(NULL), v(std::move(t)) {}
+    };
+    std::atomic<Node*> head_; //生产者追加的位置
+    Node* tail_;              //消费者持有的哨兵结点，其后为第一个元素
+    size_t capacity_;
+    std::atomic<size_t> size_;
+};
+
 typedef std::function<void()> Task; //一个Task就是一个void ()函数
 extern template class SafeQueue<Task>; //定义一个其他文件也能访问到的全局外部变量
+extern template class MpscQueue<Task>;
 
 struct ThreadPool: private noncopyable {
     //创建线程池
     ThreadPool(int threads, int taskCapacity=0, bool start=true);
     ~ThreadPool();
     void start();
+    //第i个线程绑定到cpus[i % cpus.size()]，需在start之前调用
+    ThreadPool& setAffinity(const std::vector<int>& cpus) { cpus_ = cpus; return *this; }
     ThreadPool& exit() { tasks_.exit(); return *this; }
     void join();
 
@@ -54,6 +81,7 @@ struct ThreadPool: private noncopyable {
 private:
     SafeQueue<Task> tasks_; //线程池里包括一个队列的任务，任务就是函数
     std::vector<std::thread> threads_; //和一个线程数组
+    std::vector<int> cpus_; //线程绑定的cpu，空为不绑定
 };
 
 
@@ -118,4 +146,43 @@ template<typename T> T SafeQueue<T>::pop_wait(int waitMs) {  //跟前一个类
     return r;
 }
 
+template<typename T> MpscQueue<T>::MpscQueue(size_t capacity):
+    head_(new Node()), capacity_(capacity), size_(0)
+{
+    tail_ = head_.load(std::memory_order_relaxed);
+}
+
+template<typename T> MpscQueue<T>::~MpscQueue() {
+    while (tail_) {
+        Node* next = tail_->next.load(std::memory_order_relaxed);
+        delete tail_;
+        tail_ = next;
+    }
+}
+
+template<typename T> bool MpscQueue<T>::push(T&& v) {
+    size_t n = size_.fetch_add(1, std::memory_order_relaxed);
+    if (capacity_ && n >= capacity_) {
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    Node* node = new Node(std::move(v));
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel); //先占位，再把前一个结点链接过来
+    prev->next.store(node, std::memory_order_release);
+    return true;
+}
+
+//生产者交换head_之后、链接next之前，新结点对消费者暂不可见，此时返回false，由生产者随后的唤醒再次处理
+template<typename T> bool MpscQueue<T>::pop(T* v) {
+    Node* next = tail_->next.load(std::memory_order_acquire);
+    if (next == NULL) {
+        return false;
+    }
+    *v = std::move(next->v);
+    delete tail_;
+    tail_ = next;   //next成为新的哨兵
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
 }
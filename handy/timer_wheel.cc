@@ -0,0 +1,238 @@
+#include "timer_wheel.h"
+#include "logging.h"
+#include <limits>
+
+using namespace std;
+
+namespace handy {
+
+TimerWheel::TimerWheel(int slotBits, int levels):
+    bits_(slotBits), levels_(levels), mask_((1 << slotBits) - 1),
+    heads_(levels << slotBits, -1), tails_(levels << slotBits, -1), levelCount_(levels, 0),
+    freeList_(-1), count_(0), now_(util::timeMilli()), nearest_(numeric_limits<int64_t>::max()), seq_(0)
+{
+    fatalif(slotBits < 1 || slotBits > 16 || levels < 1 || slotBits * levels > 62,
+            "bad timer wheel slot bits %d levels %d", slotBits, levels);
+}
+
+int TimerWheel::allocNode() {
+    int idx = freeList_;
+    if (idx >= 0) {
+        freeList_ = nodes_[idx].next;
+    } else {
+        idx = nodes_.size();
+        nodes_.emplace_back();
+    }
+    count_ ++;
+    return idx;
+}
+
+void TimerWheel::freeNode(int idx) {
+    Node& n = nodes_[idx];
+    n.cb = nullptr;   //尽早释放回调里捕获的对象
+    n.seq = 0;
+    n.slot = -1;
+    n.running = n.canceled = false;
+    n.next = freeList_;
+    freeList_ = idx;
+    count_ --;
+}
+
+//根据到期时间与当前时间的距离选择层，同一层中相差不到一圈的放入该层
+void TimerWheel::link(int idx) {
+    Node& n = nodes_[idx];
+    int64_t at = max(n.at, now_);
+    int level = 0;
+    int slot = 0;
+    for (; level < levels_; level ++) {
+        int shift = level * bits_;
+        if ((at >> shift) - (now_ >> shift) <= mask_) {
+            slot = (at >> shift) & mask_;
+            break;
+        }
+    }
+    if (level == levels_) { //超出时间轮范围，放在最高层最远的格子，降层时再重新放置
+        level = levels_ - 1;
+        slot = ((now_ >> (level * bits_)) + mask_) & mask_;
+    }
+    slot += level << bits_;
+    n.slot = slot;
+    n.next = -1;
+    n.prev = tails_[slot];
+    if (n.prev >= 0) {
+        nodes_[n.prev].next = idx;
+    } else {
+        heads_[slot] = idx;
+    }
+    tails_[slot] = idx;
+    levelCount_[level] ++;
+}
+
+void TimerWheel::unlink(int idx) {
+    Node& n = nodes_[idx];
+    if (n.prev >= 0) {
+        nodes_[n.prev].next = n.next;
+    } else {
+        heads_[n.slot] = n.next;
+    }
+    if (n.next >= 0) {
+        nodes_[n.next].prev = n.prev;
+    } else {
+        tails_[n.slot] = n.prev;
+    }
+    levelCount_[n.slot >> bits_] --;
+    n.slot = -1;
+}
+
+//把高层当前格子中的结点按新的距离重新放置
+void TimerWheel::cascade(int level) {
+    int slot = (level << bits_) + ((now_ >> (level * bits_)) & mask_);
+    int idx = heads_[slot];
+    heads_[slot] = tails_[slot] = -1;
+    while (idx >= 0) {
+        int next = nodes_[idx].next;
+        levelCount_[level] --;
+        link(idx);
+        idx = next;
+    }
+}
+
+TimerId TimerWheel::add(int64_t at, Task&& task, int64_t interval) {
+    if (count_ == 0) { //空闲期间没有推进时间轮，直接跳到当前时间
+        now_ = max(now_, util::timeMilli());
+    }
+    int idx = allocNode();
+    Node& n = nodes_[idx];
+    n.at = at;
+    n.interval = interval;
+    n.seq = ++seq_;
+    n.cb = move(task);
+    n.running = n.canceled = false;
+    link(idx);
+    nearest_ = min(nearest_, max(at, now_));
+    return TimerId(idx, n.seq);
+}
+
+bool TimerWheel::cancel(TimerId timerid) {
+    if (timerid.first < 0 || timerid.first >= (int64_t)nodes_.size()) {
+        return false;
+    }
+    int idx = timerid.first;
+    Node& n = nodes_[idx];
+    if (n.seq == 0 || n.seq != timerid.second || n.canceled) {
+        return false;
+    }
+    if (n.slot >= 0) {
+        unlink(idx);
+    }
+    if (n.running) { //正在执行的重复任务，回调返回后再释放
+        n.canceled = true;
+    } else {
+        freeNode(idx);
+    }
+    return true;
+}
+
+void TimerWheel::expire(int64_t now, Histogram* lag) {
+    if (now < now_) {
+        return;
+    }
+    while (now_ <= now) {
+        if (count_ == 0) {
+            now_ = now + 1;
+            break;
+        }
+        for (int level = 1; level < levels_ && (now_ & ((1LL << (level * bits_)) - 1)) == 0; level ++) {
+            cascade(level);
+        }
+        if (levelCount_[0] == 0) { //最低层为空，跳到下一次降层的时间
+            now_ = min((now_ | mask_) + 1, now + 1);
+            continue;
+        }
+        int slot = now_ & mask_;
+        now_ ++;
+        expired_.clear();
+        for (int idx = heads_[slot]; idx >= 0; idx = nodes_[idx].next) {
+            nodes_[idx].slot = -1;
+            expired_.push_back({idx, nodes_[idx].seq});
+            levelCount_[0] --;
+        }
+        heads_[slot] = tails_[slot] = -1;
+        for (size_t i = 0; i < expired_.size(); i ++) {
+            int idx = expired_[i].first;
+            Node& n = nodes_[idx];
+            if (n.seq != expired_[i].second) { //已被前面的回调取消
+                continue;
+            }
+            if (lag) {
+                lag->add(now - n.at);
+            }
+            if (n.interval == 0) {
+                Task task = move(n.cb);
+                freeNode(idx);
+                task();
+            } else {
+                n.at += n.interval;
+                link(idx);
+                n.running = true;
+                n.cb();
+                n.running = false;
+                if (n.canceled) {
+                    freeNode(idx);
+                }
+            }
+        }
+    }
+    refreshNearest();
+}
+
+int64_t TimerWheel::nearest() {
+    return nearest_;
+}
+
+//最低层给出精确的到期时间，高层给出下一次降层的时间
+void TimerWheel::refreshNearest() {
+    nearest_ = numeric_limits<int64_t>::max();
+    if (count_ == 0) {
+        return;
+    }
+    if (levelCount_[0]) {
+        for (int i = 0; i <= mask_; i ++) {
+            if (heads_[(now_ + i) & mask_] >= 0) {
+                nearest_ = now_ + i;
+                break;
+            }
+        }
+    }
+    for (int level = 1; level < levels_; level ++) {
+        if (levelCount_[level] == 0) {
+            continue;
+        }
+        int shift = level * bits_;
+        //d为0的格子只在now_恰好对齐、尚未降层时非空
+        for (int64_t d = 0; d <= mask_; d ++) {
+            int64_t prefix = (now_ >> shift) + d;
+            int64_t at = max(prefix << shift, now_);
+            if (at >= nearest_) {
+                break;
+            }
+            if (heads_[(level << bits_) + (prefix & mask_)] >= 0) {
+                nearest_ = at;
+                break;
+            }
+        }
+    }
+}
+
+void TimerWheel::clear() {
+    nodes_.clear();
+    fill(heads_.begin(), heads_.end(), -1);
+    fill(tails_.begin(), tails_.end(), -1);
+    fill(levelCount_.begin(), levelCount_.end(), 0);
+    expired_.clear();
+    freeList_ = -1;
+    count_ = 0;
+    nearest_ = numeric_limits<int64_t>::max();
+}
+
+}
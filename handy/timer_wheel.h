@@ -0,0 +1,54 @@
+#pragma once
+#include "handy-imp.h"
+#include "metrics.h"
+#include <deque>
+#include <vector>
+
+namespace handy {
+
+//分层时间轮，1毫秒一格，每层2^slotBits格，共levels层
+//插入、取消均为O(1)，到期的定时器按格批量取出执行
+//TimerId为{结点下标, 序列号}，结点复用时序列号不同，旧id取消时被忽略
+struct TimerWheel: private noncopyable {
+    TimerWheel(int slotBits=8, int levels=4);
+    //添加定时任务，at为到期的毫秒时间，interval非0为重复任务
+    TimerId add(int64_t at, Task&& task, int64_t interval);
+    //取消定时任务，任务不存在或已执行返回false
+    bool cancel(TimerId timerid);
+    //执行所有到期时间不晚于now的任务，lag非空时记录每个任务执行时晚于到期时间的毫秒数
+    void expire(int64_t now, Histogram* lag=NULL);
+    //最近一次需要处理的时间，可能早于实际到期时间，无定时器时返回INT64_MAX
+    int64_t nearest();
+    size_t size() { return count_; }
+    void clear();
+private:
+    struct Node {
+        int64_t at;         //到期时间
+        int64_t interval;   //重复间隔，0为一次性任务
+        int64_t seq;        //序列号，0表示空闲结点
+        Task cb;
+        int prev, next;     //所在格子的双向链表，空闲时next为空闲链表
+        int slot;           //所在格子，-1表示不在时间轮上
+        bool running;       //重复任务正在执行回调
+        bool canceled;      //执行回调期间被取消
+    };
+    int bits_, levels_, mask_;
+    std::deque<Node> nodes_;    //deque扩容时不移动已有结点，回调中添加定时器是安全的
+    std::vector<int> heads_, tails_;    //各层各格的链表头尾
+    std::vector<size_t> levelCount_;    //各层的结点数
+    std::vector<std::pair<int, int64_t>> expired_; //本格到期的{结点, 序列号}
+    int freeList_;
+    size_t count_;
+    int64_t now_;       //下一个待处理的格子对应的时间
+    int64_t nearest_;   //缓存的最近到期时间
+    int64_t seq_;
+
+    int allocNode();
+    void freeNode(int idx);
+    void link(int idx);
+    void unlink(int idx);
+    void cascade(int level);
+    void refreshNearest();
+};
+
+}
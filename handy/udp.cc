@@ -1,17 +1,51 @@
 #include "udp.h"
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
 
 using namespace std;
 
 namespace handy {
 
+//接收区的上限，GRO或大报文时减少每次recvmmsg收取的报文数，每个线程最多占用这么多
+static const size_t kUdpRecvSlab = 256 * 1024;
+
+//事件循环线程共用的接收区，报文先收到这里，再按实际大小复制到从内存池取得的Buffer中
+static char* recvSlab(size_t size) {
+    static thread_local std::vector<char> slab;
+    if (slab.size() < size) {
+        slab.resize(size);
+    }
+    return slab.data();
+}
+
+//小报文只占用按大小分级的小块内存
+static void copyPayload(Buffer& buf, const char* p, size_t len) {
+    buf.setSuggestSize(len);
+    buf.append(p, len);
+}
+
 UdpServer::UdpServer(EventBases *bases):
     base_(bases->allocBase()),
     bases_(bases),
-    channel_(NULL)
+    channel_(NULL),
+    batch_(1),
+    maxMsgSize_(kUdpPacketSize),
+    gso_(0),
+    gro_(false),
+    flushing_(false),
+    msgs_(1),
+    reads_(0), recvMsgs_(0), recvBytes_(0), truncated_(0), sendMsgs_(0), sendBytes_(0), sendErrors_(0)
 {
 }
 
+//计数只在事件循环线程中写，不需要原子的加法
+static void addStat(atomic<int64_t>& c, int64_t n) {
+    if (n) {
+        c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
 int UdpServer::bind(const std::string &host, short port, bool reusePort) {
     addr_ = Ip4Addr(host, port);
     int fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -19,37 +53,252 @@ int UdpServer::bind(const std::string &host, short port, bool reusePort) {
     fatalif(r, "set socket reuse option failed");
     r = net::setReusePort(fd, reusePort);
     fatalif(r, "set socket reuse port option failed");
+    if (reusePort && base_->cpu() >= 0 && net::setIncomingCpu(fd, base_->cpu())) { //与绑定了cpu的事件循环配对
+        warn("set SO_INCOMING_CPU %d on fd %d failed %d %s", base_->cpu(), fd, errno, strerror(errno));
+    }
     r = util::addFdFlag(fd, FD_CLOEXEC);
     fatalif(r, "addFdFlag FD_CLOEXEC failed");
     r = ::bind(fd,(struct sockaddr *)&addr_.getAddr(),sizeof(struct sockaddr));
     if (r) {
+        r = errno;
         close(fd);
-        error("bind to %s failed %d %s", addr_.toString().c_str(), errno, strerror(errno));
-        return errno;
+        error("bind to %s failed %d %s", addr_.toString().c_str(), r, strerror(r));
+        return r;
     }
+    socklen_t alen = sizeof(struct sockaddr_in);
+    r = getsockname(fd, (struct sockaddr*)&addr_.getAddr(), &alen); //端口为0时取得实际端口
+    fatalif(r, "getsockname failed %d %s", errno, strerror(errno));
     net::setNonBlock(fd);
     info("udp fd %d bind to %s", fd, addr_.toString().c_str());
     channel_ = new Channel(base_, fd, kReadEvent);
-    channel_->onRead([this]{
-        Buffer buf;
-        struct sockaddr_in raddr;
-        socklen_t rsz = sizeof(raddr);
-        if (!channel_ || channel_->fd() < 0) {
-            return;
+    channel_->onRead([this]{ handleRead(); });
+    return 0;
+}
+
+int UdpServer::bindPerLoop(const std::string& host, short port, bool cpuSteer) {
+    base_ = bases_->getBase(0);
+    int r = bind(host, port, true);
+    if (r) {
+        return r;
+    }
+    for (int i = 1; i < bases_->size(); i ++) {
+        UdpServerPtr s(new UdpServer(bases_->getBase(i)));
+        s->msgcb_ = msgcb_;
+        s->msgscb_ = msgscb_;
+        s->setBatch(batch_).setMaxMsgSize(maxMsgSize_);
+        r = s->bind(addr_.ip(), addr_.port(), true);
+        if (r) {
+            return r;
+        }
+        if ((gso_ && s->setGso(gso_)) || (gro_ && s->setGro(true))) {
+            warn("udp fd %d copy gso/gro setting failed", s->channel_->fd());
+        }
+        socks_.push_back(s);
+    }
+    int fd = channel_->fd();
+    if (cpuSteer && bases_->size() > 1 && net::setReusePortCpuSteer(fd, bases_->size())) {
+        warn("attach reuseport cpu steering on udp fd %d failed %d %s", fd, errno, strerror(errno));
+    }
+    return 0;
+}
+
+UdpServerPtr UdpServer::startPerLoopServer(EventBases* bases, const std::string& host, short port, bool cpuSteer) {
+    UdpServerPtr p(new UdpServer(bases));
+    int r = p->bindPerLoop(host, port, cpuSteer);
+    if (r) {
+        error("bind to %s:%d failed %d %s", host.c_str(), port, r, strerror(r));
+    }
+    return r == 0 ? p : NULL;
+}
+
+UdpStat UdpServer::stat(int i) {
+    UdpServer* s = i == 0 ? this : socks_.at(i - 1).get();
+    UdpStat st;
+    st.reads = s->reads_.load(memory_order_relaxed);
+    st.recvMsgs = s->recvMsgs_.load(memory_order_relaxed);
+    st.recvBytes = s->recvBytes_.load(memory_order_relaxed);
+    st.truncated = s->truncated_.load(memory_order_relaxed);
+    st.sendMsgs = s->sendMsgs_.load(memory_order_relaxed);
+    st.sendBytes = s->sendBytes_.load(memory_order_relaxed);
+    st.sendErrors = s->sendErrors_.load(memory_order_relaxed);
+    return st;
+}
+
+void UdpServer::handleRead() {
+    if (!channel_ || channel_->fd() < 0) {
+        return;
+    }
+    int fd = channel_->fd();
+    size_t room = gro_ ? kUdpMaxGsoSize : maxMsgSize_; //合并后的报文最长64K
+    int batch = std::max(1, std::min(batch_, (int)(kUdpRecvSlab / room)));
+    char* slab = recvSlab(room * batch);
+    int n = 0, reads = 0;
+    int64_t trunc = 0, msgs = 0, bytes = 0;
+    bool mmsg = false;
+#ifdef OS_LINUX
+    mmsg = batch_ > 1 || gro_;
+    if (mmsg) {
+        struct mmsghdr hdrs[kUdpMaxBatch];
+        struct iovec iovs[kUdpMaxBatch];
+        char ctrls[kUdpMaxBatch][CMSG_SPACE(sizeof(int))];
+        memset(hdrs, 0, sizeof(hdrs[0]) * batch);
+        for (int i = 0; i < batch; i ++) {
+            iovs[i].iov_base = slab + room * i;
+            iovs[i].iov_len = room;
+            hdrs[i].msg_hdr.msg_name = &msgs_[i].peer.getAddr();
+            hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+            if (gro_) {
+                hdrs[i].msg_hdr.msg_control = ctrls[i];
+                hdrs[i].msg_hdr.msg_controllen = sizeof ctrls[i];
+            }
         }
-        int fd = channel_->fd();
-        ssize_t rn = recvfrom(fd, buf.makeRoom(kUdpPacketSize), kUdpPacketSize, 0, (sockaddr*)&raddr, &rsz);
+        int rn = recvmmsg(fd, hdrs, batch, 0, NULL);
         if (rn < 0) {
-            error("udp %d recv failed: %d %s", fd, errno, strerror(errno));
+            if (errno != EAGAIN && errno != EINTR) {
+                error("udp %d recvmmsg failed: %d %s", fd, errno, strerror(errno));
+            }
             return;
         }
-        buf.addSize(rn);
-        trace("udp %d recv %ld bytes from %s", fd, rn, Ip4Addr(raddr).toString().data());
-        this->msgcb_(shared_from_this(), buf, raddr);
-    });
+        trace("udp %d recvmmsg %d msgs", fd, rn);
+        reads = 1;
+        for (int i = 0; i < rn; i ++) {
+            if (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                trunc ++;
+                trace("udp %d drop truncated msg from %s", fd, msgs_[i].peer.toString().c_str());
+                continue;
+            }
+            UdpMsg& m = msgs_[n ++];
+            m.peer = msgs_[i].peer;
+            m.segSize = 0;
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&hdrs[i].msg_hdr); gro_ && cm; cm = CMSG_NXTHDR(&hdrs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    memcpy(&m.segSize, CMSG_DATA(cm), sizeof(int));
+                }
+            }
+            copyPayload(m.buf, slab + room * i, hdrs[i].msg_len);
+            msgs += m.segSize ? (hdrs[i].msg_len + m.segSize - 1) / m.segSize : 1;
+            bytes += hdrs[i].msg_len;
+        }
+    }
+#endif
+    if (!mmsg) {
+        //不支持recvmmsg的平台上也最多连续读取batch_个报文
+        for (int i = 0; i < batch_; i ++) {
+            UdpMsg& m = msgs_[n];
+            struct iovec iov = { slab, room };
+            struct msghdr msg;
+            memset(&msg, 0, sizeof msg);
+            msg.msg_name = &m.peer.getAddr();
+            msg.msg_namelen = sizeof(struct sockaddr_in);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            ssize_t rn = recvmsg(fd, &msg, 0);
+            if (rn < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    error("udp %d recv failed: %d %s", fd, errno, strerror(errno));
+                }
+                break;
+            }
+            trace("udp %d recv %ld bytes from %s", fd, rn, m.peer.toString().data());
+            reads ++;
+            if (msg.msg_flags & MSG_TRUNC) {
+                trunc ++;
+                trace("udp %d drop truncated msg from %s", fd, m.peer.toString().c_str());
+                continue;
+            }
+            m.segSize = 0;
+            copyPayload(m.buf, slab, rn);
+            msgs ++;
+            bytes += rn;
+            n ++;
+        }
+    }
+    addStat(reads_, reads);
+    addStat(recvMsgs_, msgs);
+    addStat(recvBytes_, bytes);
+    addStat(truncated_, trunc);
+    if (n == 0) {
+        return;
+    }
+    UdpServerPtr self = shared_from_this();
+    if (msgscb_) {
+        msgscb_(self, msgs_.data(), n);
+    } else {
+        for (int i = 0; i < n; i ++) {
+            UdpMsg& m = msgs_[i];
+            if (m.segSize == 0 || (int)m.buf.size() <= m.segSize) {
+                msgcb_(self, std::move(m.buf), m.peer);
+                continue;
+            }
+            //GRO合并的报文拆回原来的报文逐个回调
+            for (size_t off = 0; off < m.buf.size(); off += m.segSize) {
+                Buffer seg;
+                seg.append(m.buf.begin() + off, std::min(m.buf.size() - off, (size_t)m.segSize));
+                msgcb_(self, std::move(seg), m.peer);
+            }
+        }
+    }
+    for (int i = 0; i < n && i < (int)msgs_.size(); i ++) {
+        msgs_[i].buf.clear();
+    }
+}
+
+int UdpServer::setGso(int segSize) {
+    if (!channel_ || channel_->fd() < 0) {
+        return EBADF;
+    }
+    if (net::setUdpSegment(channel_->fd(), segSize)) {
+        return errno;
+    }
+    gso_ = segSize;
+    for (auto& s: socks_) {
+        int r = s->setGso(segSize);
+        if (r) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+int UdpServer::setGro(bool on) {
+    if (!channel_ || channel_->fd() < 0) {
+        return EBADF;
+    }
+    if (net::setUdpGro(channel_->fd(), on)) {
+        return errno;
+    }
+    gro_ = on;
+    for (auto& s: socks_) {
+        int r = s->setGro(on);
+        if (r) {
+            return r;
+        }
+    }
     return 0;
 }
 
+UdpServer& UdpServer::setMaxMsgSize(size_t size) {
+    maxMsgSize_ = std::min(size, (size_t)kUdpMaxGsoSize);
+    for (auto& s: socks_) {
+        s->setMaxMsgSize(size);
+    }
+    return *this;
+}
+
+UdpServer& UdpServer::setBatch(int n) {
+    batch_ = std::max(1, std::min(n, kUdpMaxBatch));
+    msgs_.resize(batch_);
+    if (batch_ == 1) {
+        flush();
+    }
+    for (auto& s: socks_) {
+        s->setBatch(n);
+    }
+    return *this;
+}
+
 UdpServerPtr UdpServer::startServer(EventBases* bases, const std::string& host, short port, bool reusePort) {
     UdpServerPtr p(new UdpServer(bases));
     int r = p->bind(host, port, reusePort);
@@ -64,15 +313,112 @@ void UdpServer::sendTo(const char* buf, size_t len, Ip4Addr addr) {
         warn("udp sending %lu bytes to %s after channel closed", len, addr.toString().data());
         return;
     }
+    if (batch_ > 1) {
+        outq_.push_back(OutMsg{out_.size(), len, addr});
+        out_.append(buf, len);
+        if ((int)outq_.size() >= batch_) {
+            flush();
+        } else if (!flushing_) {
+            flushing_ = true;
+            UdpServerPtr self = shared_from_this();
+            base_->atLoopEnd([self] { self->flushing_ = false; self->flush(); });
+        }
+        return;
+    }
     int fd = channel_->fd();
     int wn = ::sendto(fd, buf, len, 0, (sockaddr*)&addr.getAddr(), sizeof(sockaddr));
     if (wn < 0) {
+        addStat(sendErrors_, 1);
         error("udp %d sendto %s error: %d %s", fd, addr.toString().c_str(), errno, strerror(errno));
         return;
     }
+    addSent(segments(len), wn);
     trace("udp %d sendto %s %d bytes", fd, addr.toString().c_str(), wn);
 }
 
+int64_t UdpServer::segments(size_t len) {
+    return gso_ && len > (size_t)gso_ ? (len + gso_ - 1) / gso_ : 1; //开启GSO时内核切分出的报文数
+}
+
+void UdpServer::addSent(int64_t msgs, int64_t bytes) {
+    addStat(sendMsgs_, msgs);
+    addStat(sendBytes_, bytes);
+}
+
+void UdpServer::flush() {
+    if (outq_.empty()) {
+        return;
+    }
+    if (!channel_ || channel_->fd() < 0) {
+        warn("udp dropping %lu queued msgs after channel closed", outq_.size());
+        addStat(sendErrors_, outq_.size());
+        outq_.clear();
+        out_.clear();
+        return;
+    }
+    int fd = channel_->fd();
+    size_t i = 0;
+#ifdef OS_LINUX
+    struct mmsghdr hdrs[kUdpMaxBatch];
+    struct iovec iovs[kUdpMaxBatch];
+    int counts[kUdpMaxBatch]; //每个mmsghdr包含的队列中报文数
+    auto samePeer = [](Ip4Addr& a, Ip4Addr& b) {
+        return a.getAddr().sin_addr.s_addr == b.getAddr().sin_addr.s_addr && a.getAddr().sin_port == b.getAddr().sin_port;
+    };
+    while (i < outq_.size()) {
+        int n = 0;
+        for (size_t k = i; n < kUdpMaxBatch && k < outq_.size(); n ++) {
+            OutMsg& m = outq_[k];
+            size_t len = m.len;
+            int cnt = 1;
+            //开启GSO时，发往同一对端、除最后一个外长度都等于gso_的连续报文在out_中相邻，合并为一个报文由内核切分
+            while (gso_ && k + cnt < outq_.size() && cnt < kUdpMaxSegments && outq_[k + cnt - 1].len == (size_t)gso_
+                   && len + outq_[k + cnt].len <= (size_t)kUdpMaxGsoSize && samePeer(outq_[k + cnt].peer, m.peer)) {
+                len += outq_[k + cnt].len;
+                cnt ++;
+            }
+            memset(&hdrs[n], 0, sizeof hdrs[n]);
+            iovs[n].iov_base = out_.begin() + m.off;
+            iovs[n].iov_len = len;
+            hdrs[n].msg_hdr.msg_name = &m.peer.getAddr();
+            hdrs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            hdrs[n].msg_hdr.msg_iov = &iovs[n];
+            hdrs[n].msg_hdr.msg_iovlen = 1;
+            counts[n] = cnt;
+            k += cnt;
+        }
+        int wn = sendmmsg(fd, hdrs, n, 0);
+        if (wn < 0) { //第一个报文出错，跳过它继续发送后面的
+            error("udp %d sendmmsg to %s error: %d %s", fd, outq_[i].peer.toString().c_str(), errno, strerror(errno));
+            addStat(sendErrors_, counts[0]);
+            i += counts[0];
+            continue;
+        }
+        trace("udp %d sendmmsg %d msgs", fd, wn);
+        int64_t msgs = 0, bytes = 0;
+        for (int j = 0; j < wn; j ++) {
+            i += counts[j];
+            msgs += segments(iovs[j].iov_len);
+            bytes += iovs[j].iov_len;
+        }
+        addSent(msgs, bytes);
+    }
+#else
+    for (; i < outq_.size(); i ++) {
+        OutMsg& m = outq_[i];
+        int wn = ::sendto(fd, out_.begin() + m.off, m.len, 0, (sockaddr*)&m.peer.getAddr(), sizeof(sockaddr));
+        if (wn < 0) {
+            addStat(sendErrors_, 1);
+            error("udp %d sendto %s error: %d %s", fd, m.peer.toString().c_str(), errno, strerror(errno));
+        } else {
+            addSent(segments(m.len), wn);
+        }
+    }
+#endif
+    outq_.clear();
+    out_.clear();
+}
+
 UdpConnPtr UdpConn::createConnection(EventBase* base, const string& host, short port) {
     Ip4Addr addr(host, port);
     int fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -93,22 +439,46 @@ UdpConnPtr UdpConn::createConnection(EventBase* base, const string& host, short
     con->base_ = base;
     Channel* ch = new Channel(base, fd, kReadEvent);
     con->channel_ = ch;
-    ch->onRead([con]{
-        if (!con->channel_ || con->channel_->fd() < 0) {
-            return con->close();
-        }
-        Buffer input;
-        int fd = con->channel_->fd();
-        int rn = ::read(fd, input.makeRoom(kUdpPacketSize), kUdpPacketSize);
-        if (rn < 0) {
+    ch->onRead([con]{ con->handleRead(con); });
+    return con;
+}
+
+void UdpConn::handleRead(const UdpConnPtr& con) {
+    if (!channel_ || channel_->fd() < 0) {
+        return close();
+    }
+    int fd = channel_->fd();
+    char* slab = recvSlab(maxMsgSize_);
+    struct iovec iov = { slab, maxMsgSize_ };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t rn = recvmsg(fd, &msg, 0);
+    if (rn < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
             error("udp read from %d error %d %s", fd, errno, strerror(errno));
-            return;
         }
-        trace("udp %d read %d bytes", fd, rn);
-        input.addSize(rn);
-        con->cb_(con, input);
-    });
-    return con;
+        return;
+    }
+    trace("udp %d read %ld bytes", fd, rn);
+    if (msg.msg_flags & MSG_TRUNC) {
+        truncated_ ++;
+        trace("udp %d drop truncated msg", fd);
+        return;
+    }
+    Buffer input;
+    copyPayload(input, slab, rn);
+    reading_ = true;
+    cb_(con, input);
+    reading_ = false;
+}
+
+int UdpConn::setGso(int segSize) {
+    if (!channel_ || channel_->fd() < 0) {
+        return EBADF;
+    }
+    return net::setUdpSegment(channel_->fd(), segSize) ? errno : 0;
 }
 
 void UdpConn::close() {
@@ -116,7 +486,11 @@ void UdpConn::close() {
         return;
     auto p = channel_;
     channel_=NULL;
-    base_->safeCall([p](){ delete p; });
+    if (reading_) { //channel的读回调还在执行，回调持有本连接，返回后再释放
+        base_->safeCall([p](){ delete p; });
+    } else {
+        delete p;
+    }
 }
 
 void UdpConn::send(const char *buf, size_t len) {
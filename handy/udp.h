@@ -10,14 +10,43 @@ namespace handy {
     typedef std::shared_ptr<UdpServer> UdpServerPtr;
     typedef std::function<void(const UdpConnPtr&, Buffer)> UdpCallBack;
     typedef std::function<void(const UdpServerPtr&, Buffer, Ip4Addr)> UdpSvrCallBack;
-    const int kUdpPacketSize = 4096;
+    const int kUdpPacketSize = 4096;   //默认的最大报文大小
+    const int kUdpMaxBatch = 64;
+    const int kUdpMaxGsoSize = 65507;   //GSO一次发送、GRO一次收到的最大数据
+    const int kUdpMaxSegments = 64;     //GSO一次发送的最多报文数
+    //批量收取的一个报文
+    struct UdpMsg {
+        Buffer buf;
+        Ip4Addr peer;
+        int segSize = 0;    //开启GRO时，buf由多个该大小的报文合并而成（最后一个可以较短），0表示未合并
+    };
+    typedef std::function<void(const UdpServerPtr&, UdpMsg* msgs, int n)> UdpSvrMsgsCallBack;
+    //UdpServer一个socket的统计，报文数按应用的报文计，GRO/GSO合并的按原报文数计
+    struct UdpStat {
+        int64_t reads;        //收到报文的recvmsg/recvmmsg次数，recvMsgs / reads为平均每次收取的报文数
+        int64_t recvMsgs;     //收到的报文数
+        int64_t recvBytes;    //收到的字节数
+        int64_t truncated;    //超过最大报文而丢弃的报文数
+        int64_t sendMsgs;     //发出的报文数
+        int64_t sendBytes;    //发出的字节数
+        int64_t sendErrors;   //发送失败的报文数
+    };
     //Udp服务器
     struct UdpServer : public std::enable_shared_from_this<UdpServer>, private noncopyable {
         UdpServer(EventBases* bases);
         //return 0 on sucess, errno on error
         int bind(const std::string& host, short port, bool reusePort=false);
         static UdpServerPtr startServer(EventBases* bases, const std::string& host, short port, bool reusePort=false);
+        //每个EventBase各开一个reuseport socket，报文在收到它的循环中处理，回调的第一个参数是该循环的socket，
+        //用它回复的报文从同一个socket、在同一个线程中发出。本对象是第0个循环的socket，设置会同步到其他socket，需在loop之前调用
+        //cpuSteer为true时挂上cBPF程序，cpu i上收到的报文交给第i % size()个循环，配合MultiBase::setAffinity使用
+        int bindPerLoop(const std::string& host, short port, bool cpuSteer=false);
+        static UdpServerPtr startPerLoopServer(EventBases* bases, const std::string& host, short port, bool cpuSteer=false);
         ~UdpServer() { delete channel_; }
+        //socket的个数，每个循环各自一个socket时为循环数，否则为1
+        int sockets() { return 1 + (int)socks_.size(); }
+        //第i个socket的统计，可在任意线程调用
+        UdpStat stat(int i=0);
         Ip4Addr getAddr() { return addr_; }
         EventBase* getBase() { return base_; }
         void sendTo(Buffer msg, Ip4Addr addr) { sendTo(msg.data(), msg.size(), addr); msg.clear(); }
@@ -26,19 +55,54 @@ namespace handy {
         void sendTo(const char* s, Ip4Addr addr) { sendTo(s, strlen(s), addr); }
 
         //消息的处理
-        void onMsg(const UdpSvrCallBack& cb) { msgcb_ = cb; }
+        void onMsg(const UdpSvrCallBack& cb) { msgcb_ = cb; for (auto& s: socks_) s->onMsg(cb); }
+        //批量处理一次收到的消息，设置后不再调用onMsg的回调，msgs[i].buf可以移走
+        void onMsgs(const UdpSvrMsgsCallBack& cb) { msgscb_ = cb; for (auto& s: socks_) s->onMsgs(cb); }
+        //n>1时每次可读用recvmmsg最多收取n个报文，n不超过kUdpMaxBatch；sendTo先放入队列，满n个或本轮循环结束时用sendmmsg一起发出
+        //此时sendTo只能在事件循环线程调用。默认为1，每个报文一次recvfrom/sendto
+        UdpServer& setBatch(int n);
+        int batch() { return batch_; }
+        //能收取的最大报文，默认kUdpPacketSize，不超过kUdpMaxGsoSize。更长的报文被内核截断，丢弃并计入truncated
+        //报文先收到事件循环线程共用的接收区，再复制到按实际大小从内存池取得的Buffer中
+        UdpServer& setMaxMsgSize(size_t size);
+        size_t maxMsgSize() { return maxMsgSize_; }
+        //超过最大报文而丢弃的报文数
+        int64_t truncated() { return truncated_.load(std::memory_order_relaxed); }
+        //立即发出队列中的报文
+        void flush();
+        //开启UDP_SEGMENT(GSO)，长于segSize的报文由内核按segSize切分；批量发送时，发往同一对端的连续segSize大小的报文
+        //合并为一次发送，最多kUdpMaxSegments个、kUdpMaxGsoSize字节。0关闭，return 0 on success, errno on error
+        int setGso(int segSize);
+        //开启UDP_GRO，同一对端的连续报文可能合并后一次收到，onMsgs从UdpMsg::segSize得到原报文大小，
+        //onMsg的回调仍逐个收到拆开后的报文。return 0 on success, errno on error
+        int setGro(bool on);
     private:
+        struct OutMsg { size_t off, len; Ip4Addr peer; };
         EventBase* base_;
         EventBases* bases_;
         Ip4Addr addr_;
         Channel*channel_;
         UdpSvrCallBack msgcb_;
+        UdpSvrMsgsCallBack msgscb_;
+        int batch_;
+        size_t maxMsgSize_;
+        int gso_;
+        bool gro_;
+        bool flushing_;                 //flush已加入本轮结束时的任务
+        std::vector<UdpMsg> msgs_;      //接收缓冲，交给回调后再从内存池补充
+        Buffer out_;                    //队列中报文的数据
+        std::vector<OutMsg> outq_;
+        std::vector<UdpServerPtr> socks_;   //每个循环各自一个socket时，第1个及之后循环的socket
+        std::atomic<int64_t> reads_, recvMsgs_, recvBytes_, truncated_, sendMsgs_, sendBytes_, sendErrors_; //只在事件循环线程中写
+        void handleRead();
+        void addSent(int64_t msgs, int64_t bytes);
+        int64_t segments(size_t len);
     };
 
     //Udp连接，使用引用计数
     struct UdpConn: public std::enable_shared_from_this<UdpConn>, private noncopyable {
         //Udp构造函数，实际可用的连接应当通过createConnection创建
-        UdpConn(){};
+        UdpConn(): maxMsgSize_(kUdpPacketSize), truncated_(0), reading_(false) {};
         virtual ~UdpConn() {close();};
         static UdpConnPtr createConnection(EventBase* base, const std::string& host, short port);
         //automatically managed context. allocated when first used, deleted when destruct
@@ -53,6 +117,15 @@ namespace handy {
         void send(const std::string& s) { send(s.data(), s.size()); }
         void send(const char* s) { send(s, strlen(s)); }
         void onMsg(const UdpCallBack& cb) { cb_ = cb; }
+        //能收取的最大报文，默认kUdpPacketSize，不超过kUdpMaxGsoSize，更长的报文丢弃并计入truncated
+        void setMaxMsgSize(size_t size) { maxMsgSize_ = std::min(size, (size_t)kUdpMaxGsoSize); }
+        size_t maxMsgSize() { return maxMsgSize_; }
+        int64_t truncated() { return truncated_; }
+        //开启UDP_SEGMENT(GSO)，之后send长于segSize的数据由内核按segSize切成多个报文，
+        //多个同样大小的报文可以拼在一起一次发送，最多kUdpMaxSegments个、kUdpMaxGsoSize字节
+        //0关闭，return 0 on success, errno on error
+        int setGso(int segSize);
+        //在事件循环线程中调用，立即关闭socket并释放channel；在本连接的onMsg回调中调用时channel延后到回调返回后释放
         void close();
         //远程地址的字符串
         std::string str() { return peer_.toString(); }
@@ -65,6 +138,9 @@ namespace handy {
         std::string destHost_;
         int destPort_;
         UdpCallBack cb_;
+        size_t maxMsgSize_;
+        int64_t truncated_;
+        bool reading_; //正在执行onMsg回调
     };
 
     typedef std::function<std::string (const UdpServerPtr&, const std::string&, Ip4Addr)> RetMsgUdpCallBack;
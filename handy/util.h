@@ -29,6 +29,11 @@ struct util {
     }
     static int64_t atoi(const char* b) { return atoi(b, b+strlen(b)); }
     static int addFdFlag(int fd, int flag);
+    //32位整数的混合哈希（murmur3的finalizer）
+    static uint32_t hash32(uint32_t h) {
+        h ^= h >> 16; h *= 0x85ebca6b; h ^= h >> 13; h *= 0xc2b2ae35; h ^= h >> 16;
+        return h;
+    }
 };
 
 struct ExitCaller: private noncopyable { //这个也是个ExitCaller
@@ -1,7 +1,17 @@
 #include <handy/conn.h>
 #include <handy/logging.h>
+#include <handy/timer_wheel.h>
+#include <handy/http.h>
+#include <handy/file.h>
+#include <handy/udp.h>
 #include "test_harness.h"
 #include <thread>
+#include <fcntl.h>
+#include <sys/resource.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
 
 using namespace std;
 using namespace handy;
@@ -40,6 +50,107 @@ TEST(test::TestBase, Timer) {
     base.loop();
 }
 
+TEST(test::TestBase, TimerWheel) {
+    //每层4格，共2层，只覆盖16毫秒，用来覆盖降层和超出范围的情况
+    TimerWheel wheel(2, 2);
+    int64_t t0 = util::timeMilli() + 1000;
+    vector<pair<int64_t, int64_t>> fired; //{到期时间, 实际执行时间}
+    int64_t cur = 0;
+    for (int64_t off: {0, 1, 3, 17, 40, 99, 99}) {
+        wheel.add(t0 + off, [&, off] { fired.push_back({t0 + off, cur}); }, 0);
+    }
+    TimerId canceled = wheel.add(t0 + 5, [&] { fired.push_back({-1, cur}); }, 0);
+    int reps = 0;
+    TimerId rep;
+    rep = wheel.add(t0 + 10, [&] { if (++reps == 3) ASSERT_TRUE(wheel.cancel(rep)); }, 7);
+    ASSERT_EQ(9u, wheel.size());
+    ASSERT_TRUE(wheel.cancel(canceled));
+    ASSERT_FALSE(wheel.cancel(canceled));
+    ASSERT_LE(wheel.nearest(), t0);
+    for (cur = t0 - 1000; cur <= t0 + 100; cur ++) {
+        wheel.expire(cur);
+    }
+    ASSERT_EQ(7u, fired.size());
+    for (auto& f: fired) {
+        ASSERT_EQ(f.first, f.second);
+    }
+    ASSERT_EQ(3, reps);
+    ASSERT_EQ(0u, wheel.size());
+    ASSERT_FALSE(wheel.cancel(rep));
+}
+
+TEST(test::TestBase, WakeupBurst) {
+    EventBase base;
+    int done = 0;
+    thread th([&] {
+        for (int i = 0; i < 200000; i ++) {
+            base.safeCall([&] { done ++; });
+        }
+    });
+    th.join(); //事件循环未运行时大量唤醒也不会阻塞
+    //不断重新加入自己的任务不能饿死定时器
+    function<void()> flood = [&] { base.safeCall(flood); };
+    base.safeCall(flood);
+    base.runAfter(50, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ(200000, done);
+}
+
+TEST(test::TestBase, SpinLoop) {
+    EventBase base(0, 1000);
+    thread th([&] {
+        for (int i = 0; i < 200; i ++) {
+            usleep(100);
+            base.safeCall([]{});
+        }
+        usleep(50000); //长时间空闲，自旋预算应当减小
+        base.exit();
+    });
+    base.loop();
+    th.join();
+    LoopStat st = base.loopStat();
+    info("spin %lld us hits %lld block %lld us blocks %lld budget %lld us", (long long)st.spinUs, (long long)st.spinHits,
+         (long long)st.blockUs, (long long)st.blocks, (long long)st.spinBudgetUs);
+    ASSERT_GT(st.spinHits, 0);
+    ASSERT_GT(st.spinUs, 0);
+    ASSERT_GT(st.blocks, 0);
+    ASSERT_LT(st.spinBudgetUs, 1000);
+}
+
+TEST(test::TestBase, Histogram) {
+    Histogram h;
+    for (int i = 1; i <= 1000; i ++) {
+        h.add(i);
+    }
+    ASSERT_EQ(1000, h.count());
+    ASSERT_EQ(1000, h.max());
+    ASSERT_EQ(500500, h.sum());
+    //分桶的相对误差不超过1/8
+    for (double p: {0.5, 0.9, 0.99}) {
+        int64_t v = h.percentile(p);
+        ASSERT_GE(v, (int64_t)(1000 * p));
+        ASSERT_LE(v, (int64_t)(1000 * p * 9 / 8) + 1);
+    }
+    ASSERT_EQ(1000, h.percentile(1));
+}
+
+TEST(test::TestBase, LoopMetrics) {
+    EventBase base;
+    base.runAfter(5, [&] { usleep(2000); });
+    base.runAfter(20, [&] { base.exit(); });
+    thread th([&] { base.safeCall([]{}); });
+    base.loop();
+    th.join();
+    const LoopMetrics& m = base.loopMetrics();
+    info("%s", m.toString().c_str());
+    ASSERT_GT(m.events.count(), 0);
+    ASSERT_GT(m.waitUs.count(), 0);
+    ASSERT_EQ(2, m.timerLagMs.count());
+    ASSERT_GT(m.handlerUs.count(), 0);
+    ASSERT_GE(m.taskDepth.count(), 1);
+    ASSERT_GE(m.busyUs.max(), 2000);
+}
+
 TEST(test::TestBase, TcpServer1) {
     EventBase base;
     ThreadPool th(2);
@@ -84,4 +195,897 @@ TEST(test::TestBase, kevent) {
     });
     base.runAfter(5, [con, &base]{con->closeNow(); base.exit(); });
     base.loop();
-}
\ No newline at end of file
+}
+TEST(test::TestBase, EdgeTrigger) {
+    EventBase base;
+    base.setEdgeTrigger(true);
+    TcpServer echo(&base);
+    int r = echo.bind("", 2099);
+    ASSERT_EQ(r, 0);
+    echo.onConnRead([](const TcpConnPtr& con) {
+        con->send(con->getInput());
+    });
+    string big(4*1024*1024, 'e');
+    size_t recved = 0;
+    TcpConnPtr con = TcpConn::createConnection(&base, "localhost", 2099);
+    con->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected)
+            con->send(big);
+    });
+    con->onRead([&](const TcpConnPtr& con) {
+        recved += con->getInput().size();
+        con->getInput().clear();
+        if (recved == big.size()) {
+            base.exit();
+        }
+    });
+    base.runAfter(3000, [&]{ base.exit(); });
+    base.loop();
+    ASSERT_TRUE(con->getChannel() == NULL || con->getChannel()->edgeTriggered());
+    ASSERT_EQ(big.size(), recved);
+}
+
+TEST(test::TestBase, ConnectRefused) {
+    EventBase base;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2098);
+    int states = 0;
+    con->onState([&](const TcpConnPtr&) { states ++; });
+    for (int i = 0; i < 5 && con->getState() == TcpConn::Handshaking; i ++) {
+        base.loop_once(50);
+    }
+    ASSERT_EQ(TcpConn::Failed, con->getState());
+    ASSERT_EQ(1, states);
+}
+
+TEST(test::TestBase, ReconnectConnCount) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    svr.onConnCreate([] {
+        TcpConnPtr con(new TcpConn);
+        con->setReconnectInterval(100); //服务端的连接没有目标地址，不会重连
+        return con;
+    });
+    TcpConnPtr cli = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    for (int i = 0; i < 100 && base.connCount() < 2; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, base.connCount());
+    cli->close();
+    for (int i = 0; i < 100 && base.connCount() > 0; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(0, base.connCount());
+
+    //等待重连的连接在循环退出时清除，连接数不再减少
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2098);
+    con->setReconnectInterval(1000);
+    for (int i = 0; i < 5 && con->getState() == TcpConn::Handshaking; i ++) {
+        base.loop_once(50);
+    }
+    ASSERT_EQ(TcpConn::Failed, con->getState());
+    ASSERT_EQ(0, base.connCount());
+    base.exit();
+    base.loop();
+    ASSERT_EQ(0, base.connCount());
+}
+
+TEST(test::TestBase, MultiBasePolicy) {
+    MultiBase bases(3, MultiBase::PeerHash);
+    set<EventBase*> hit;
+    for (int i = 0; i < 100; i ++) {
+        Ip4Addr peer(util::format("10.0.%d.%d", i / 10, i % 10), 1000);
+        EventBase* b = bases.allocBase(peer);
+        ASSERT_EQ(b, bases.allocBase(Ip4Addr(peer.ip(), 2000))); //同一ip总是落在同一个循环
+        hit.insert(b);
+    }
+    ASSERT_EQ(3u, hit.size());
+
+    //不带peer分配时也按处理时间，同一周期内连续分配轮到不同的循环
+    MultiBase busy(3, MultiBase::LeastBusy);
+    set<EventBase*> picked;
+    for (int i = 0; i < 3; i ++) {
+        picked.insert(busy.allocBase());
+    }
+    ASSERT_EQ(3u, picked.size());
+
+    //按连接数分配，连接关闭后计数减少
+    MultiBase multi(3, MultiBase::LeastConns);
+    TcpServerPtr svr = TcpServer::startServer(&multi, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    EventBase base;
+    vector<TcpConnPtr> clis;
+    int connected = 0;
+    for (int i = 0; i < 6; i ++) {
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+        con->onState([&](const TcpConnPtr& con) {
+            if (con->getState() == TcpConn::Connected && ++connected == 6) {
+                base.runAfter(50, [&] { base.exit(); });
+            }
+        });
+        clis.push_back(con);
+    }
+    thread th([&] { multi.loop(); });
+    base.loop();
+    for (int i = 0; i < 3; i ++) {
+        ASSERT_EQ(2, multi.getBase(i)->connCount());
+    }
+    for (auto& con: clis) {
+        con->closeNow();
+    }
+    clis.clear();
+    usleep(50 * 1000);
+    int total = 0;
+    for (int i = 0; i < 3; i ++) {
+        total += multi.getBase(i)->connCount();
+    }
+    ASSERT_EQ(0, total);
+    multi.exit();
+    th.join();
+}
+
+TEST(test::TestBase, LoopAffinity) {
+#ifdef OS_LINUX
+    MultiBase bases(2);
+    bases.setAffinity(vector<int>{0});
+    ASSERT_EQ(0, bases.getBase(1)->cpu());
+    atomic<int> cpus[2];
+    for (int i = 0; i < 2; i ++) {
+        cpus[i] = -1;
+        bases.getBase(i)->safeCall([&, i] { cpus[i] = sched_getcpu(); });
+    }
+    thread th([&] { bases.loop(); });
+    usleep(50 * 1000);
+    bases.exit();
+    th.join();
+    ASSERT_EQ(0, cpus[0].load());
+    ASSERT_EQ(0, cpus[1].load());
+    //绑定了cpu的EventBase上的reuseport监听设置SO_INCOMING_CPU
+    EventBase base;
+    base.setCpu(0);
+    TcpServerPtr svr = TcpServer::startServer(&base, "127.0.0.1", 2099, true);
+    ASSERT_TRUE(svr != NULL);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(0, net::setIncomingCpu(fd, 0));
+    close(fd);
+#endif
+}
+
+TEST(test::TestBase, PerLoopServer) {
+    MultiBase multi(3);
+    TcpServerPtr svr = TcpServer::startPerLoopServer(&multi, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    mutex mu;
+    map<EventBase*, int> accepted;
+    svr->onConnState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            lock_guard<mutex> lk(mu);
+            accepted[con->getBase()] ++;
+        }
+    });
+    EventBase base;
+    vector<TcpConnPtr> clis;
+    int connected = 0;
+    for (int i = 0; i < 30; i ++) {
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+        con->onState([&](const TcpConnPtr& con) {
+            if (con->getState() == TcpConn::Connected && ++connected == 30) {
+                base.runAfter(50, [&] { base.exit(); });
+            }
+        });
+        clis.push_back(con);
+    }
+    thread th([&] { multi.loop(); });
+    base.loop();
+    //每个循环都从自己的监听socket上接受到了连接，连接留在accept它的循环中
+    int total = 0;
+    for (int i = 0; i < 3; i ++) {
+        lock_guard<mutex> lk(mu);
+        ASSERT_GT(accepted[multi.getBase(i)], 0);
+        ASSERT_EQ(accepted[multi.getBase(i)], multi.getBase(i)->connCount());
+        total += accepted[multi.getBase(i)];
+    }
+    ASSERT_EQ(30, total);
+    for (auto& con: clis) {
+        con->closeNow();
+    }
+    multi.exit();
+    th.join();
+#ifdef OS_LINUX
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    net::setReusePort(fd);
+    Ip4Addr addr("127.0.0.1", 2098);
+    ASSERT_EQ(0, ::bind(fd, (sockaddr*)&addr.getAddr(), sizeof(sockaddr_in)));
+    ASSERT_EQ(0, listen(fd, 20));
+    ASSERT_EQ(0, net::setReusePortCpuSteer(fd, 3));
+    close(fd);
+#endif
+}
+
+TEST(test::TestBase, AcceptBudget) {
+    EventBase base;
+    TcpServer svr(&base);
+    svr.setBacklog(64);
+    svr.setAcceptBudget(2);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    ASSERT_NE(0, svr.getAddr().port()); //绑定端口0时取得实际端口
+    vector<TcpConnPtr> cons;
+    svr.onConnState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            cons.push_back(con);
+        }
+    });
+    vector<int> fds;
+    for (int i = 0; i < 10; i ++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_EQ(0, connect(fd, (sockaddr*)&svr.getAddr().getAddr(), sizeof(sockaddr_in)));
+        fds.push_back(fd);
+    }
+    base.loop_once(100);
+    ASSERT_EQ(2, svr.acceptStat().accepted); //每次可读最多accept 2个
+    for (int i = 0; i < 50 && svr.acceptStat().accepted < 10; i ++) {
+        base.loop_once(100);
+    }
+    AcceptStat st = svr.acceptStat();
+    ASSERT_EQ(10, st.accepted);
+    ASSERT_GE(st.budgetHits, 4);
+    ASSERT_GE(st.wakeups, 5);
+    ASSERT_EQ(0, st.failed);
+    for (int i = 0; i < 10 && cons.size() < 10; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(10u, cons.size());
+    for (auto& con: cons) {
+        ASSERT_EQ(svr.getAddr().toString(), con->local_.toString());
+        ASSERT_TRUE(fcntl(con->channel_->fd(), F_GETFL) & O_NONBLOCK);
+        ASSERT_TRUE(fcntl(con->channel_->fd(), F_GETFD) & FD_CLOEXEC);
+    }
+    for (int fd: fds) {
+        close(fd);
+    }
+}
+
+TEST(test::TestBase, AcceptShed) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    svr.setMaxConns(3);
+    auto connectN = [&](int n) {
+        vector<int> fds;
+        for (int i = 0; i < n; i ++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            connect(fd, (sockaddr*)&svr.getAddr().getAddr(), sizeof(sockaddr_in));
+            fds.push_back(fd);
+        }
+        return fds;
+    };
+    auto loopUntil = [&](function<bool()> done) {
+        for (int i = 0; i < 100 && !done(); i ++) {
+            base.loop_once(10);
+        }
+    };
+    int replaced = 0;
+    svr.onConnState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) { //连接自己替换状态回调，连接数仍在清除时减少
+            con->onState([&](const TcpConnPtr&) { replaced ++; });
+        }
+    });
+    //超过服务器的连接数上限，接受后立即关闭
+    vector<int> fds = connectN(6);
+    loopUntil([&] { return svr.acceptStat().accepted == 6; });
+    loopUntil([&] { return base.connCount() == 3; });
+    ASSERT_EQ(3, svr.connCount());
+    ASSERT_EQ(3, svr.acceptStat().shedLimit);
+    ASSERT_EQ(3, base.connCount());
+    close(fds[0]);
+    loopUntil([&] { return svr.connCount() == 2; });
+    ASSERT_EQ(2, svr.connCount());
+    for (size_t i = 1; i < fds.size(); i ++) {
+        close(fds[i]);
+    }
+    loopUntil([&] { return svr.connCount() == 0; });
+    ASSERT_EQ(0, svr.connCount());
+    ASSERT_EQ(3, replaced);
+    svr.setMaxConns(0);
+
+    //fd耗尽时借助备用fd接受并关闭连接
+    fds = connectN(2);
+    struct rlimit old, lim;
+    getrlimit(RLIMIT_NOFILE, &old);
+    lim = old;
+    lim.rlim_cur = 256;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    vector<int> fill;
+    int fd;
+    while ((fd = dup(0)) >= 0) {
+        fill.push_back(fd);
+    }
+    loopUntil([&] { return svr.acceptStat().shedNoFd == 2; });
+    ASSERT_EQ(2, svr.acceptStat().shedNoFd);
+    for (int f: fill) {
+        close(f);
+    }
+    setrlimit(RLIMIT_NOFILE, &old);
+    for (int f: fds) {
+        close(f);
+    }
+
+    //循环延迟过高时暂停accept，延迟降下来后恢复
+    svr.setPauseOnLag(1000);
+    for (int i = 0; i < 16; i ++) {
+        base.safeCall([] { usleep(5000); });
+        base.loop_once(10);
+    }
+    ASSERT_GT(base.loopLagUs(), 1000);
+    int64_t accepted = svr.acceptStat().accepted;
+    fds = connectN(1);
+    base.loop_once(10);
+    ASSERT_EQ(1, svr.acceptStat().pauses);
+    ASSERT_EQ(accepted, svr.acceptStat().accepted);
+    loopUntil([&] { return svr.acceptStat().accepted == accepted + 1; });
+    ASSERT_EQ(accepted + 1, svr.acceptStat().accepted);
+    close(fds[0]);
+}
+
+TEST(test::TestBase, ChunkedSend) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    string received;
+    svr.onConnRead([&](const TcpConnPtr& con) {
+        received.append(con->getInput().data(), con->getInput().size());
+        con->getInput().clear();
+    });
+    string big(4 << 20, 'x');
+    for (size_t i = 0; i < big.size(); i += 4096) {
+        big[i] = 'a' + i / 4096 % 26;
+    }
+    int released = 0;
+    string expect;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    con->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            //依次发送复制的、借用的、整块移入的数据，接收端按顺序拼接
+            con->send("head");
+            con->sendRef(big.data(), big.size(), [&] { released ++; });
+            Buffer mid;
+            mid.append("mid");
+            con->send(mid);
+            ASSERT_EQ(0u, mid.size());
+            con->sendRef("tail", 4, [&] { released ++; });
+            con->send("end");
+            expect = "head" + big + "mid" + "tail" + "end";
+            ASSERT_GT(con->outputSize(), 0u);
+        }
+    });
+    for (int i = 0; i < 1000 && received.size() < big.size() + 14; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, released);
+    ASSERT_EQ(0u, con->outputSize());
+    ASSERT_TRUE(received == expect);
+
+    //连接关闭时未发送完的借用数据也会释放
+    released = 0;
+    con->sendRef(big.data(), big.size(), [&] { released ++; });
+    con->sendRef(big.data(), big.size(), [&] { released ++; });
+    ASSERT_GT(con->outputSize(), 0u);
+    con->closeNow();
+    ASSERT_EQ(2, released);
+}
+
+TEST(test::TestBase, BufferPool) {
+    BufferPool::trim();
+    BufferPool::Stat st0 = BufferPool::stat();
+    {
+        Buffer b;
+        for (int i = 0; i < 100; i ++) { //每条消息读完后清空，内存回到池中再取出
+            b.append(string(1000, 'a'));
+            b.consume(b.size());
+        }
+    }
+    BufferPool::Stat st = BufferPool::stat();
+    ASSERT_EQ(1, st.allocs - st0.allocs);
+    ASSERT_EQ(99, st.hits - st0.hits);
+    ASSERT_EQ(1024u, st.cached);
+
+    //一问一答的连接，预热后收发不再向系统分配
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    svr.onConnRead([](const TcpConnPtr& con) { con->send(con->getInput()); });
+    int rounds = 0;
+    string msg(3000, 'x');
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    con->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send(msg);
+        }
+    });
+    con->onRead([&](const TcpConnPtr& con) {
+        if (con->getInput().size() == msg.size()) {
+            con->getInput().clear();
+            rounds ++;
+            if (rounds == 10) {
+                st0 = BufferPool::stat();
+            }
+            con->send(msg);
+        }
+    });
+    for (int i = 0; i < 1000 && rounds < 110; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_GE(rounds, 110);
+    st = BufferPool::stat();
+    ASSERT_EQ(st0.allocs, st.allocs);
+    ASSERT_GT(st.hits, st0.hits);
+
+    BufferPool::trim();
+    ASSERT_EQ(0u, BufferPool::stat().cached);
+}
+
+TEST(test::TestBase, ConnFootprint) {
+    //channel已嵌在连接中，1000万连接时每个连接的大小直接决定内存预算
+    ASSERT_LE(sizeof(TcpConn), 448u);
+#ifdef HAVE_MALLINFO2
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    svr.onConnMsg(new LengthCodec, [](const TcpConnPtr& con, Slice msg) { con->sendMsg(msg); });
+    svr.onConnState([](const TcpConnPtr&) {});
+    svr.setMaxConns(100000);
+    const int n = 200;
+    vector<int> fds;
+    base.loop_once(0);
+    size_t before = mallinfo2().uordblks;
+    for (int i = 0; i < n; i ++) { //客户端用裸socket，只统计服务端连接的内存
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        Ip4Addr addr("127.0.0.1", 2099);
+        ASSERT_EQ(0, connect(fd, (sockaddr*)&addr.getAddr(), sizeof(sockaddr_in)));
+        fds.push_back(fd);
+        base.loop_once(0);
+    }
+    for (int i = 0; i < 100 && svr.connCount() < n; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(n, svr.connCount());
+    size_t perConn = (mallinfo2().uordblks - before) / n;
+    info("heap per server connection %lu bytes", (unsigned long)perConn);
+    ASSERT_LT(perConn, 768u); //回调共享、输出队列为空时不分配
+    for (int fd: fds) {
+        close(fd);
+    }
+    for (int i = 0; i < 100 && svr.connCount() > 0; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(0, svr.connCount());
+#endif
+}
+
+TEST(test::TestBase, ReadvDrain) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    TcpConnPtr peer;
+    svr.onConnCreate([&] { peer = make_shared<TcpConn>(); return peer; });
+    int reads = 0;
+    string received;
+    svr.onConnRead([&](const TcpConnPtr& con) {
+        reads ++;
+        received.append(con->getInput().data(), con->getInput().size());
+        con->getInput().clear();
+    });
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    Ip4Addr addr("127.0.0.1", 2099);
+    ASSERT_EQ(0, connect(fd, (sockaddr*)&addr.getAddr(), sizeof(sockaddr_in)));
+    for (int i = 0; i < 100 && !peer; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(peer != NULL);
+    string data(100 * 1024, 0);
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = 'a' + i % 26;
+    }
+    ASSERT_EQ((ssize_t)data.size(), write(fd, data.data(), data.size()));
+    usleep(10000);
+    //超过栈上备用区的数据在一次可读事件中读完，只回调一次
+    for (int i = 0; i < 100 && received.size() < data.size(); i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(1, reads);
+    ASSERT_TRUE(received == data);
+    close(fd);
+}
+
+TEST(test::TestBase, ZeroCopySend) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    string received;
+    svr.onConnRead([&](const TcpConnPtr& con) {
+        received.append(con->getInput().data(), con->getInput().size());
+        con->getInput().clear();
+    });
+    svr.onConnState([](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send("hi");
+        }
+    });
+    string big(4 << 20, 'x');
+    for (size_t i = 0; i < big.size(); i += 4096) {
+        big[i] = 'a' + i / 4096 % 26;
+    }
+    int released = 0, zc = -1;
+    string expect;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    int reads = 0;
+    con->onRead([&](const TcpConnPtr&) { reads ++; }); //不取走数据，完成通知不应再次调用读回调
+    con->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            zc = con->setZeroCopy(64 * 1024);
+            con->send("head");
+            con->sendRef(big.data(), big.size(), [&] { released ++; });
+            Buffer mid;
+            mid.append(big.data(), 1 << 20);
+            con->send(mid);
+            con->sendRef("tail", 4, [&] { released ++; }); //小于阈值，仍然复制发送
+            expect = "head" + big + big.substr(0, 1 << 20) + "tail";
+        }
+    });
+    //复制发送的mid也走零拷贝，它的完成通知可能晚于数据到达
+    for (int i = 0; i < 1000 && (received.size() < expect.size() || released < 2 || expect.empty() || con->zeroCopyStat().pending); i ++) {
+        base.loop_once(10);
+    }
+    if (zc == ENOPROTOOPT || zc == EOPNOTSUPP) { //内核不支持
+        return;
+    }
+    ASSERT_EQ(0, zc);
+    ASSERT_TRUE(received == expect);
+    ASSERT_EQ(2, released);
+    ZeroCopyStat st = con->zeroCopyStat();
+    ASSERT_GT(st.sends, 0);
+    ASSERT_EQ(st.sends, st.completions);
+    ASSERT_EQ(0, st.pending);
+    ASSERT_EQ(1, reads);
+}
+
+TEST(test::TestBase, UdpBatch) {
+    EventBase base;
+    UdpServerPtr svr = UdpServer::startServer(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    svr->setBatch(16);
+    int calls = 0, maxBatch = 0;
+    svr->onMsgs([&](const UdpServerPtr& p, UdpMsg* msgs, int n) {
+        calls ++;
+        maxBatch = max(maxBatch, n);
+        for (int i = 0; i < n; i ++) {
+            p->sendTo(msgs[i].buf, msgs[i].peer);
+        }
+    });
+    UdpConnPtr con = UdpConn::createConnection(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(con != NULL);
+    set<string> replies;
+    con->onMsg([&](const UdpConnPtr&, Buffer buf) {
+        replies.insert(string(buf.data(), buf.size()));
+    });
+    for (int i = 0; i < 100; i ++) { //事件循环开始前全部写入，服务端一次可读时能批量收取
+        con->send(util::format("msg-%d", i));
+    }
+    for (int i = 0; i < 200 && replies.size() < 100; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(100u, replies.size());
+    ASSERT_TRUE(replies.count("msg-0") && replies.count("msg-99"));
+    ASSERT_EQ(16, maxBatch);
+    ASSERT_LT(calls, 100);
+
+    svr->setBatch(1);
+    svr->onMsgs(nullptr);
+    replies.clear();
+    Buffer moved;
+    svr->onMsg([&](const UdpServerPtr& p, Buffer buf, Ip4Addr peer) {
+        p->sendTo(buf.data(), buf.size(), peer);
+        moved = buf;
+    });
+    con->send("single");
+    for (int i = 0; i < 200 && replies.empty(); i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(1u, replies.count("single"));
+    ASSERT_EQ(6u, moved.size());
+    con->close();
+}
+
+TEST(test::TestBase, UdpGsoGro) {
+    EventBase base;
+    UdpServerPtr svr = UdpServer::startServer(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    vector<string> got;
+    svr->onMsg([&](const UdpServerPtr&, Buffer buf, Ip4Addr) { got.push_back(string(buf.data(), buf.size())); });
+    UdpConnPtr con = UdpConn::createConnection(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(con != NULL);
+    int r = con->setGso(1000);
+    if (r == ENOPROTOOPT || r == EINVAL) { //内核不支持
+        return;
+    }
+    ASSERT_EQ(0, r);
+    string data;
+    for (int i = 0; i < 10; i ++) {
+        data += string(1000, 'a' + i);
+    }
+    auto waitFor = [&](size_t n) {
+        for (int i = 0; i < 200 && got.size() < n; i ++) {
+            base.loop_once(10);
+        }
+    };
+    //未开启GRO时收到内核切分后的10个报文
+    con->send(data);
+    waitFor(10);
+    ASSERT_EQ(10u, got.size());
+    ASSERT_TRUE(got[9] == string(1000, 'j'));
+
+    //开启GRO后合并收到，onMsgs得到原报文大小
+    ASSERT_EQ(0, svr->setGro(true));
+    got.clear();
+    int segSize = -1;
+    svr->onMsgs([&](const UdpServerPtr&, UdpMsg* msgs, int n) {
+        for (int i = 0; i < n; i ++) {
+            got.push_back(string(msgs[i].buf.data(), msgs[i].buf.size()));
+            if (msgs[i].segSize) {
+                segSize = msgs[i].segSize;
+            }
+        }
+    });
+    con->send(data);
+    size_t total = 0;
+    for (int i = 0; i < 200 && total < data.size(); i ++) {
+        base.loop_once(10);
+        total = 0;
+        for (auto& g: got) {
+            total += g.size();
+        }
+    }
+    ASSERT_EQ(data.size(), total);
+    ASSERT_TRUE(segSize == -1 || segSize == 1000);
+    //onMsg的回调收到拆开后的报文
+    svr->onMsgs(nullptr);
+    got.clear();
+    con->send(data);
+    waitFor(10);
+    ASSERT_EQ(10u, got.size());
+    ASSERT_TRUE(got[0] == string(1000, 'a') && got[9] == string(1000, 'j'));
+
+    //批量发送时发往同一对端的等长报文合并发送，对端仍收到10个报文
+    vector<string> replies;
+    con->onMsg([&](const UdpConnPtr&, Buffer buf) { replies.push_back(string(buf.data(), buf.size())); });
+    svr->setBatch(16);
+    ASSERT_EQ(0, svr->setGso(500));
+    svr->onMsg([&](const UdpServerPtr& p, Buffer, Ip4Addr peer) {
+        for (int i = 0; i < 10; i ++) {
+            p->sendTo(string(500, 'k' + i), peer);
+        }
+    });
+    ASSERT_EQ(0, con->setGso(0));
+    con->send("go");
+    for (int i = 0; i < 200 && replies.size() < 10; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(10u, replies.size());
+    ASSERT_TRUE(replies[0] == string(500, 'k') && replies[9] == string(500, 't'));
+    con->close();
+}
+
+TEST(test::TestBase, UdpMaxMsgSize) {
+    EventBase base;
+    UdpServerPtr svr = UdpServer::startServer(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    vector<string> got;
+    size_t space = 0;
+    svr->onMsg([&](const UdpServerPtr& p, Buffer buf, Ip4Addr peer) {
+        got.push_back(string(buf.data(), buf.size()));
+        space = buf.space();
+        p->sendTo(string(200, 'r'), peer);
+    });
+    UdpConnPtr con = UdpConn::createConnection(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(con != NULL);
+    int replies = 0;
+    con->onMsg([&](const UdpConnPtr&, Buffer) { replies ++; });
+    con->setMaxMsgSize(100); //服务端回复200字节，客户端全部丢弃
+    auto waitFor = [&](size_t n) {
+        for (int i = 0; i < 100 && got.size() < n; i ++) {
+            base.loop_once(10);
+        }
+    };
+    con->send(string(5000, 'a')); //超过默认的4096，丢弃
+    con->send(string(40, 'b'));
+    waitFor(1);
+    ASSERT_EQ(1u, got.size());
+    ASSERT_TRUE(got[0] == string(40, 'b'));
+    ASSERT_LT(space, 64u); //按报文大小分配，不再占用4K
+    ASSERT_EQ(1, svr->truncated());
+
+    svr->setMaxMsgSize(9000);
+    con->send(string(5000, 'c'));
+    waitFor(2);
+    ASSERT_EQ(2u, got.size());
+    ASSERT_EQ(5000u, got[1].size());
+
+    svr->setBatch(8);
+    con->send(string(100, 'd'));
+    con->send(string(20000, 'e'));
+    con->send(string(100, 'f'));
+    waitFor(4);
+    ASSERT_EQ(4u, got.size());
+    ASSERT_TRUE(got[2] == string(100, 'd') && got[3] == string(100, 'f'));
+    ASSERT_EQ(2, svr->truncated());
+
+    for (int i = 0; i < 100 && con->truncated() < 4; i ++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(4, con->truncated());
+    ASSERT_EQ(0, replies);
+    con->close();
+}
+
+TEST(test::TestBase, UdpPerLoopServer) {
+    MultiBase multi(3);
+    UdpServerPtr svr = UdpServer::startPerLoopServer(&multi, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    ASSERT_EQ(3, svr->sockets());
+    svr->setBatch(8);
+    mutex mu;
+    map<EventBase*, int> handled;
+    svr->onMsgs([&](const UdpServerPtr& p, UdpMsg* msgs, int n) {
+        {
+            lock_guard<mutex> lk(mu);
+            handled[p->getBase()] += n;
+        }
+        for (int i = 0; i < n; i ++) {
+            p->sendTo(msgs[i].buf, msgs[i].peer); //从收到报文的socket回复
+        }
+    });
+    EventBase base;
+    vector<UdpConnPtr> clis;
+    int replies = 0;
+    for (int i = 0; i < 30; i ++) { //不同的源端口按四元组哈希到不同的socket
+        UdpConnPtr con = UdpConn::createConnection(&base, "127.0.0.1", 2099);
+        con->onMsg([&](const UdpConnPtr&, Buffer) {
+            if (++replies == 60) {
+                base.exit();
+            }
+        });
+        clis.push_back(con);
+    }
+    thread th([&] { multi.loop(); });
+    for (auto& con: clis) {
+        con->send("ping");
+        con->send("ping");
+    }
+    base.runAfter(3000, [&] { base.exit(); });
+    base.loop();
+    multi.exit();
+    th.join();
+    ASSERT_EQ(60, replies);
+    int total = 0, busy = 0;
+    for (int i = 0; i < 3; i ++) {
+        UdpStat st = svr->stat(i);
+        ASSERT_EQ(handled[multi.getBase(i)], st.recvMsgs);
+        ASSERT_EQ(st.recvMsgs, st.sendMsgs);
+        ASSERT_EQ(st.recvMsgs * 4, st.recvBytes);
+        ASSERT_EQ(0, st.sendErrors);
+        total += st.recvMsgs;
+        busy += st.recvMsgs > 0;
+    }
+    ASSERT_EQ(60, total);
+    ASSERT_GT(busy, 1);
+    for (auto& con: clis) {
+        con->close();
+    }
+#ifdef OS_LINUX
+    //端口为0时其他循环绑定到第0个socket取得的端口，cBPF程序挂在组上
+    MultiBase steered(2);
+    UdpServerPtr svr2 = UdpServer::startPerLoopServer(&steered, "127.0.0.1", 0, true);
+    ASSERT_TRUE(svr2 != NULL);
+    ASSERT_NE(0, svr2->getAddr().port());
+    ASSERT_EQ(2, svr2->sockets());
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    net::setReusePort(fd);
+    Ip4Addr addr("127.0.0.1", 2098);
+    ASSERT_EQ(0, ::bind(fd, (sockaddr*)&addr.getAddr(), sizeof(sockaddr_in)));
+    ASSERT_EQ(0, net::setReusePortCpuSteer(fd, 2));
+    close(fd);
+#endif
+}
+
+TEST(test::TestBase, HttpSendFile) {
+    string path = "/tmp/handy-sendfile-test";
+    string cont(300 * 1024, 0);
+    for (size_t i = 0; i < cont.size(); i ++) {
+        cont[i] = 'a' + i % 26;
+    }
+    ASSERT_TRUE(file::writeContent(path, cont).ok());
+    OpenFilePtr f1, f2;
+    FileCache cache;
+    ASSERT_TRUE(cache.open(path, &f1).ok());
+    ASSERT_TRUE(cache.open(path, &f2).ok());
+    ASSERT_EQ(f1.get(), f2.get()); //同一路径复用打开的fd
+    ASSERT_EQ((int64_t)cont.size(), f1->size);
+    ASSERT_EQ(ENOENT, cache.open(path + ".none", &f2).code());
+
+    EventBase base;
+    HttpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 2099));
+    svr.onGet("/f", [&](const HttpConnPtr& con) { con.sendFile(path); });
+    //依次请求整个文件、区间、末尾、小区间、两个格式错误的区间、无法满足的区间
+    vector<pair<string, string>> reqs = {
+        {"", cont}, {"bytes=100-199", cont.substr(100, 100)}, {"bytes=-20000", cont.substr(cont.size() - 20000)},
+        {"bytes=307000-", cont.substr(307000)}, {"bytes=abc-", cont}, {"bytes=200-100", cont}, {"bytes=400000-", ""},
+    };
+    vector<int> status;
+    vector<string> bodies;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    HttpResponse resp;
+    auto sendReq = [&](const TcpConnPtr& con) {
+        string r = reqs[status.size()].first;
+        con->send("GET /f HTTP/1.1\r\n" + (r.size() ? "Range: " + r + "\r\n" : string()) + "\r\n");
+    };
+    con->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            sendReq(con);
+        }
+    });
+    con->onRead([&](const TcpConnPtr& con) {
+        while (resp.tryDecode(con->getInput()) == HttpMsg::Complete) {
+            status.push_back(resp.status);
+            bodies.push_back(resp.body);
+            con->getInput().consume(resp.getByte());
+            resp.clear();
+            if (status.size() == reqs.size()) {
+                base.exit();
+            } else {
+                sendReq(con);
+            }
+        }
+    });
+    base.runAfter(3000, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ(reqs.size(), status.size());
+    ASSERT_EQ(200, status[0]);
+    ASSERT_EQ(206, status[1]);
+    ASSERT_EQ(206, status[2]);
+    ASSERT_EQ(206, status[3]);
+    ASSERT_EQ(200, status[4]); //格式错误时忽略Range，发送整个文件
+    ASSERT_EQ(200, status[5]);
+    ASSERT_EQ(416, status[6]);
+    for (size_t i = 0; i < 6; i ++) {
+        ASSERT_TRUE(bodies[i] == reqs[i].second);
+    }
+
+    //文件比约定的长度短时关闭连接，不再发送后续数据
+    EventBase base2;
+    TcpServer svr2(&base2);
+    ASSERT_EQ(0, svr2.bind("127.0.0.1", 2097));
+    svr2.onConnState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Connected) {
+            int fd = open(path.c_str(), O_RDONLY);
+            con->sendFile(fd, 0, cont.size() + 1000, [fd] { close(fd); });
+            con->send("tail");
+        }
+    });
+    size_t got = 0;
+    TcpConnPtr cli = TcpConn::createConnection(&base2, "127.0.0.1", 2097);
+    cli->onRead([&](const TcpConnPtr& con) {
+        got += con->getInput().size();
+        con->getInput().clear();
+    });
+    cli->onState([&](const TcpConnPtr& con) {
+        if (con->getState() == TcpConn::Closed) {
+            base2.exit();
+        }
+    });
+    base2.runAfter(3000, [&] { base2.exit(); });
+    base2.loop();
+    ASSERT_EQ(TcpConn::Closed, cli->getState());
+    ASSERT_EQ(cont.size(), got);
+    unlink(path.c_str());
+}
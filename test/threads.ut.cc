@@ -59,3 +59,57 @@ TEST(test::TestBase, SafeQueue) {
     ASSERT_EQ(q.size(), 0);
 }
 
+
+TEST(test::TestBase, MpscQueue) {
+    MpscQueue<int> q;
+    const int producers = 4, per = 100000;
+    vector<thread> ths;
+    for (int p = 0; p < producers; p ++) {
+        ths.push_back(thread([&q, p] {
+            for (int i = 0; i < per; i ++) {
+                q.push(p * per + i);
+            }
+        }));
+    }
+    vector<int> last(producers, -1);
+    int recved = 0;
+    while (recved < producers * per) {
+        int v = 0;
+        if (!q.pop(&v)) {
+            continue;
+        }
+        int p = v / per;
+        ASSERT_LT(last[p], v % per); //同一生产者的元素保持顺序
+        last[p] = v % per;
+        recved ++;
+    }
+    for (auto& t: ths) {
+        t.join();
+    }
+    ASSERT_EQ(0u, q.size());
+
+    MpscQueue<int> bounded(2);
+    ASSERT_TRUE(bounded.push(1));
+    ASSERT_TRUE(bounded.push(2));
+    ASSERT_FALSE(bounded.push(3));
+    int v = 0;
+    ASSERT_TRUE(bounded.pop(&v));
+    ASSERT_EQ(1, v);
+    ASSERT_TRUE(bounded.push(3));
+}
+
+TEST(test::TestBase, ThreadPoolAffinity) {
+#ifdef OS_LINUX
+    ThreadPool pool(2, 0, false);
+    pool.setAffinity({0});
+    atomic<int> onCpu0(0);
+    for (int i = 0; i < 4; i ++) {
+        pool.addTask([&] { onCpu0 += sched_getcpu() == 0; });
+    }
+    pool.start();
+    usleep(50 * 1000);
+    pool.exit();
+    pool.join();
+    ASSERT_EQ(4, onCpu0.load());
+#endif
+}